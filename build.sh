@@ -1,6 +1,15 @@
 #!/bin/sh
 
-cflags="-Wall -pedantic -std=gnu11 -ggdb"
+cflags="-Wall -pedantic -std=gnu11 -ggdb -fopenmp"
 gcc main.c -o main.o -c ${cflags}
 gcc pmx_model.c -o pmx_model.o -c ${cflags}
-gcc main.o pmx_model.o -o main
+gcc pmx_optimize.c -o pmx_optimize.o -c ${cflags}
+gcc pmx_bvh.c -o pmx_bvh.o -c ${cflags}
+gcc pmx_physics.c -o pmx_physics.o -c ${cflags}
+gcc pmx_reload.c -o pmx_reload.o -c ${cflags}
+gcc pmx_layout.c -o pmx_layout.o -c ${cflags}
+gcc pmx_write.c -o pmx_write.o -c ${cflags}
+gcc pmx_tangent.c -o pmx_tangent.o -c ${cflags}
+gcc pmx_lod.c -o pmx_lod.o -c ${cflags}
+gcc pmx_vmd.c -o pmx_vmd.o -c ${cflags}
+gcc main.o pmx_model.o pmx_optimize.o pmx_bvh.o pmx_physics.o pmx_reload.o pmx_layout.o pmx_write.o pmx_tangent.o pmx_lod.o pmx_vmd.o -o main -fopenmp -lm
@@ -0,0 +1,435 @@
+#include "pmx_bvh.h"
+#include "pmx_internal.h"
+
+#include <float.h>
+#include <math.h>
+
+#define BIN_COUNT 16
+#define MIN_LEAF_SIZE 4
+#define MAX_LEAF_SIZE 16
+#define PARALLEL_THRESHOLD 4096
+#define SAH_MAX_DEPTH 64
+/* traversal stack, pmx_build_bvh rejects trees deeper than it holds */
+#define STACK_SIZE 128
+
+typedef struct
+{
+	PMXBVH *bvh;
+	const PMXAABB *face_bounds;
+	const float (*centroids)[3];
+} BuildContext;
+
+static void aabb_extend(PMXAABB *box, const PMXAABB *other)
+{
+	for (size_t i = 0; i < 3; ++i) {
+		box->min[i] = MIN(box->min[i], other->min[i]);
+		box->max[i] = MAX(box->max[i], other->max[i]);
+	}
+}
+
+static int aabb_overlap(const PMXAABB *a, const PMXAABB *b)
+{
+	for (size_t i = 0; i < 3; ++i)
+		if (a->max[i] < b->min[i] || b->max[i] < a->min[i])
+			return 0;
+	return 1;
+}
+
+static float aabb_area(const PMXAABB *box)
+{
+	float d[3];
+
+	for (size_t i = 0; i < 3; ++i)
+		d[i] = MAX(box->max[i] - box->min[i], 0.0f);
+	return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+static void face_bounds(const PMXModel *model, uint32_t face, PMXAABB *box)
+{
+	pmx_aabb_reset(box);
+	for (size_t i = 0; i < 3; ++i)
+		pmx_aabb_extend(box, model->vertices[model->faces[face].indices[i]].pos);
+}
+
+/* NaN and infinite centroids, which make the scale meaningless, land in bin 0 */
+static int centroid_bin(float centroid, float lo, float scale)
+{
+	float f = (centroid - lo) * scale;
+	if (!(f > 0.0f))
+		return 0;
+	return f < BIN_COUNT - 1 ? (int)f : BIN_COUNT - 1;
+}
+
+static void make_leaf(PMXBVH *bvh, PMXBVHNode *node, uint32_t first, uint32_t count, uint32_t depth)
+{
+	node->first = first;
+	node->count = count;
+
+	uint32_t deepest = __atomic_load_n(&bvh->depth, __ATOMIC_RELAXED);
+	while (depth > deepest &&
+	       !__atomic_compare_exchange_n(&bvh->depth, &deepest, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void build_node(const BuildContext *ctx, uint32_t node_idx, uint32_t first, uint32_t count, uint32_t depth)
+{
+	PMXBVH *bvh = ctx->bvh;
+	PMXBVHNode *node = &bvh->nodes[node_idx];
+	uint32_t *faces = bvh->faces + first;
+	PMXAABB centroid_bounds;
+
+	pmx_aabb_reset(&node->bounds);
+	pmx_aabb_reset(&centroid_bounds);
+	for (uint32_t i = 0; i < count; ++i) {
+		aabb_extend(&node->bounds, &ctx->face_bounds[faces[i]]);
+		pmx_aabb_extend(&centroid_bounds, ctx->centroids[faces[i]]);
+	}
+
+	if (count <= MIN_LEAF_SIZE) {
+		make_leaf(bvh, node, first, count, depth);
+		return;
+	}
+
+	int axis = 0;
+	for (int i = 1; i < 3; ++i)
+		if (centroid_bounds.max[i] - centroid_bounds.min[i] >
+		    centroid_bounds.max[axis] - centroid_bounds.min[axis])
+			axis = i;
+
+	float lo = centroid_bounds.min[axis];
+	float extent = centroid_bounds.max[axis] - lo;
+	uint32_t split = count / 2;
+
+	/* past SAH_MAX_DEPTH fall back to halving, which bounds the depth
+	 * and with it the traversal stack */
+	if (extent > 0.0f && depth < SAH_MAX_DEPTH) {
+		PMXAABB bin_bounds[BIN_COUNT];
+		uint32_t bin_count[BIN_COUNT] = { 0 };
+		float scale = BIN_COUNT / extent;
+
+		for (int i = 0; i < BIN_COUNT; ++i)
+			pmx_aabb_reset(&bin_bounds[i]);
+		for (uint32_t i = 0; i < count; ++i) {
+			int bin = centroid_bin(ctx->centroids[faces[i]][axis], lo, scale);
+			++bin_count[bin];
+			aabb_extend(&bin_bounds[bin], &ctx->face_bounds[faces[i]]);
+		}
+
+		/* sweep from the right, then evaluate each plane from the left */
+		float right_cost[BIN_COUNT];
+		PMXAABB acc;
+		uint32_t acc_count = 0;
+		pmx_aabb_reset(&acc);
+		for (int i = BIN_COUNT - 1; i > 0; --i) {
+			aabb_extend(&acc, &bin_bounds[i]);
+			acc_count += bin_count[i];
+			right_cost[i] = acc_count ? aabb_area(&acc) * acc_count : 0.0f;
+		}
+
+		float best_cost = FLT_MAX;
+		int best_plane = -1;
+		pmx_aabb_reset(&acc);
+		acc_count = 0;
+		for (int i = 1; i < BIN_COUNT; ++i) {
+			aabb_extend(&acc, &bin_bounds[i - 1]);
+			acc_count += bin_count[i - 1];
+			if (acc_count == 0 || acc_count == count)
+				continue;
+			float cost = aabb_area(&acc) * acc_count + right_cost[i];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_plane = i;
+			}
+		}
+
+		float leaf_cost = aabb_area(&node->bounds) * count;
+		if (best_cost >= leaf_cost && count <= MAX_LEAF_SIZE) {
+			make_leaf(bvh, node, first, count, depth);
+			return;
+		}
+
+		/* finite centroids with extent > 0 fill the first and last bin, so only
+		 * non-finite ones can leave no separating plane; those are halved */
+		if (best_plane > 0) {
+			uint32_t l = 0, r = count;
+			while (l < r) {
+				int bin = centroid_bin(ctx->centroids[faces[l]][axis], lo, scale);
+				if (bin < best_plane) {
+					++l;
+				} else {
+					uint32_t tmp = faces[l];
+					faces[l] = faces[--r];
+					faces[r] = tmp;
+				}
+			}
+			split = l;
+		}
+	} else if (count <= MAX_LEAF_SIZE) {
+		make_leaf(bvh, node, first, count, depth);
+		return;
+	}
+
+	uint32_t left = __atomic_fetch_add(&bvh->node_count, 2, __ATOMIC_RELAXED);
+	node->first = left;
+	node->count = 0;
+
+	if (count > PARALLEL_THRESHOLD) {
+		#pragma omp task
+		build_node(ctx, left, first, split, depth + 1);
+	} else {
+		build_node(ctx, left, first, split, depth + 1);
+	}
+	build_node(ctx, left + 1, first + split, count - split, depth + 1);
+}
+
+int pmx_build_bvh(const PMXModel *model, PMXBVH *dst)
+{
+	memset(dst, 0, sizeof(*dst));
+	dst->model = model;
+
+	for (size_t i = 0; i < model->face_count; ++i) {
+		for (size_t j = 0; j < 3; ++j) {
+			if (model->faces[i].indices[j] >= model->vertex_count) {
+				pmx_set_error_msg("Face %zu references vertex %u out of range\n",
+					i, model->faces[i].indices[j]);
+				return -1;
+			}
+		}
+	}
+
+	dst->mat_first_face = malloc((model->material_count + 1) * sizeof(uint32_t));
+	if (!dst->mat_first_face) {
+		pmx_set_error_msg("Out of memory for BVH\n");
+		return -1;
+	}
+	dst->mat_first_face[0] = 0;
+	for (size_t i = 0; i < model->material_count; ++i)
+		dst->mat_first_face[i + 1] = dst->mat_first_face[i] + model->materials[i].face_count / 3;
+
+	uint32_t count = model->face_count;
+	dst->face_count = count;
+	if (count == 0)
+		return 0;
+
+	PMXAABB *bounds = malloc(count * sizeof(PMXAABB));
+	float (*centroids)[3] = malloc(count * sizeof(*centroids));
+	dst->faces = malloc(count * sizeof(uint32_t));
+	dst->nodes = malloc((2 * (size_t)count - 1) * sizeof(PMXBVHNode));
+	if (!bounds || !centroids || !dst->faces || !dst->nodes) {
+		free(centroids);
+		free(bounds);
+		pmx_free_bvh(dst);
+		pmx_set_error_msg("Out of memory for BVH\n");
+		return -1;
+	}
+
+	#pragma omp parallel for
+	for (uint32_t i = 0; i < count; ++i) {
+		face_bounds(model, i, &bounds[i]);
+		for (size_t j = 0; j < 3; ++j)
+			centroids[i][j] = 0.5f * (bounds[i].min[j] + bounds[i].max[j]);
+		dst->faces[i] = i;
+	}
+
+	BuildContext ctx = { dst, bounds, (const float (*)[3])centroids };
+	dst->node_count = 1;
+	#pragma omp parallel
+	#pragma omp single
+	build_node(&ctx, 0, 0, count, 0);
+
+	free(centroids);
+	free(bounds);
+	/* halving past SAH_MAX_DEPTH keeps this far below STACK_SIZE, checked so
+	 * traversal never has to */
+	if (dst->depth + 1 > STACK_SIZE) {
+		pmx_free_bvh(dst);
+		pmx_set_error_msg("BVH depth %u exceeds the traversal stack\n", dst->depth);
+		return -1;
+	}
+	TRACE("BVH nodes: %u\n", dst->node_count);
+	return 0;
+}
+
+void pmx_free_bvh(PMXBVH *bvh)
+{
+	if (bvh->nodes) {
+		free(bvh->nodes);
+		bvh->nodes = NULL;
+	}
+
+	if (bvh->faces) {
+		free(bvh->faces);
+		bvh->faces = NULL;
+	}
+
+	if (bvh->mat_first_face) {
+		free(bvh->mat_first_face);
+		bvh->mat_first_face = NULL;
+	}
+}
+
+static uint32_t face_material(const PMXBVH *bvh, uint32_t face)
+{
+	uint32_t lo = 0, hi = bvh->model->material_count;
+
+	if (face >= bvh->mat_first_face[hi])
+		return PMX_INVALID_IDX;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (bvh->mat_first_face[mid + 1] <= face)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int ray_box(const PMXAABB *box, const float origin[3], const float inv_dir[3], float t_max, float *t_near)
+{
+	float t0 = 0.0f, t1 = t_max;
+
+	for (size_t i = 0; i < 3; ++i) {
+		float a = (box->min[i] - origin[i]) * inv_dir[i];
+		float b = (box->max[i] - origin[i]) * inv_dir[i];
+		t0 = MAX(t0, MIN(a, b));
+		t1 = MIN(t1, MAX(a, b));
+	}
+	*t_near = t0;
+	return t0 <= t1;
+}
+
+/* Moller-Trumbore, both windings */
+static int ray_triangle(const float origin[3], const float dir[3], const float *p0, const float *p1, const float *p2, float *t, float *u, float *v)
+{
+	float e1[3], e2[3], s[3], p[3], q[3];
+
+	for (size_t i = 0; i < 3; ++i) {
+		e1[i] = p1[i] - p0[i];
+		e2[i] = p2[i] - p0[i];
+		s[i] = origin[i] - p0[i];
+	}
+	p[0] = dir[1] * e2[2] - dir[2] * e2[1];
+	p[1] = dir[2] * e2[0] - dir[0] * e2[2];
+	p[2] = dir[0] * e2[1] - dir[1] * e2[0];
+
+	float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+	if (fabsf(det) < 1e-12f)
+		return 0;
+	float inv_det = 1.0f / det;
+
+	*u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+	if (*u < 0.0f || *u > 1.0f)
+		return 0;
+
+	q[0] = s[1] * e1[2] - s[2] * e1[1];
+	q[1] = s[2] * e1[0] - s[0] * e1[2];
+	q[2] = s[0] * e1[1] - s[1] * e1[0];
+	*v = (dir[0] * q[0] + dir[1] * q[1] + dir[2] * q[2]) * inv_det;
+	if (*v < 0.0f || *u + *v > 1.0f)
+		return 0;
+
+	*t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+	return 1;
+}
+
+int pmx_bvh_raycast(const PMXBVH *bvh, const float origin[3], const float dir[3], float t_max, PMXRayHit *hit)
+{
+	const PMXModel *model = bvh->model;
+	float inv_dir[3];
+	uint32_t stack[STACK_SIZE];
+	size_t top = 0;
+	int found = 0;
+	float t_near;
+
+	if (bvh->face_count == 0)
+		return 0;
+
+	for (size_t i = 0; i < 3; ++i)
+		inv_dir[i] = 1.0f / dir[i];
+
+	if (ray_box(&bvh->nodes[0].bounds, origin, inv_dir, t_max, &t_near))
+		stack[top++] = 0;
+
+	while (top > 0) {
+		const PMXBVHNode *node = &bvh->nodes[stack[--top]];
+
+		if (node->count > 0) {
+			for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+				uint32_t face = bvh->faces[i];
+				const uint32_t *idx = model->faces[face].indices;
+				float t, u, v;
+
+				if (!ray_triangle(origin, dir, model->vertices[idx[0]].pos,
+						model->vertices[idx[1]].pos, model->vertices[idx[2]].pos, &t, &u, &v))
+					continue;
+				if (t < 0.0f || t > t_max)
+					continue;
+
+				t_max = t;
+				hit->face = face;
+				hit->t = t;
+				hit->bary[0] = 1.0f - u - v;
+				hit->bary[1] = u;
+				hit->bary[2] = v;
+				found = 1;
+			}
+			continue;
+		}
+
+		/* push the farther child first so the nearer one is visited next */
+		float t_left, t_right;
+		int hit_left = ray_box(&bvh->nodes[node->first].bounds, origin, inv_dir, t_max, &t_left);
+		int hit_right = ray_box(&bvh->nodes[node->first + 1].bounds, origin, inv_dir, t_max, &t_right);
+
+		if (hit_left && hit_right) {
+			if (t_left < t_right) {
+				stack[top++] = node->first + 1;
+				stack[top++] = node->first;
+			} else {
+				stack[top++] = node->first;
+				stack[top++] = node->first + 1;
+			}
+		} else if (hit_left || hit_right) {
+			stack[top++] = node->first + (hit_left ? 0 : 1);
+		}
+	}
+
+	if (found)
+		hit->material = face_material(bvh, hit->face);
+	return found;
+}
+
+uint32_t pmx_bvh_query_aabb(const PMXBVH *bvh, const PMXAABB *box, uint32_t *faces, uint32_t max_faces)
+{
+	uint32_t stack[STACK_SIZE];
+	size_t top = 0;
+	uint32_t found = 0;
+
+	if (bvh->face_count == 0)
+		return 0;
+
+	stack[top++] = 0;
+	while (top > 0) {
+		const PMXBVHNode *node = &bvh->nodes[stack[--top]];
+
+		if (!aabb_overlap(&node->bounds, box))
+			continue;
+
+		if (node->count > 0) {
+			for (uint32_t i = node->first; i < node->first + node->count; ++i) {
+				PMXAABB bounds;
+				face_bounds(bvh->model, bvh->faces[i], &bounds);
+				if (!aabb_overlap(&bounds, box))
+					continue;
+				if (found < max_faces)
+					faces[found] = bvh->faces[i];
+				++found;
+			}
+		} else {
+			stack[top++] = node->first;
+			stack[top++] = node->first + 1;
+		}
+	}
+
+	return found;
+}
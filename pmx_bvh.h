@@ -0,0 +1,57 @@
+#ifndef __PMX_BVH_H
+#define __PMX_BVH_H
+
+#include "pmx_model.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/* Inner nodes have count == 0 and their children at first and first + 1,
+ * leaves cover faces[first, first + count). */
+typedef struct
+{
+	PMXAABB bounds;
+	uint32_t first;
+	uint32_t count;
+} PMXBVHNode;
+
+/* Borrows the model, which must stay unchanged while the BVH is in use. */
+typedef struct
+{
+	const PMXModel *model;
+	uint32_t node_count;
+	PMXBVHNode *nodes;
+	/* of the deepest leaf; traversal holds at most depth + 1 pending nodes */
+	uint32_t depth;
+	uint32_t face_count;
+	uint32_t *faces;
+	uint32_t *mat_first_face;
+} PMXBVH;
+
+typedef struct
+{
+	uint32_t face;
+	uint32_t material;
+	float t;
+	float bary[3];
+} PMXRayHit;
+
+/* Binned SAH build over all faces; large subtrees are split in parallel
+ * when built with OpenMP. */
+int pmx_build_bvh(const PMXModel *model, PMXBVH *dst);
+void pmx_free_bvh(PMXBVH *bvh);
+
+/* Closest hit along origin + t * dir for t in [0, t_max].
+ * Returns 1 on hit, 0 otherwise. bary weights the face's three vertices. */
+int pmx_bvh_raycast(const PMXBVH *bvh, const float origin[3], const float dir[3], float t_max, PMXRayHit *hit);
+
+/* Collects faces whose bounds overlap box. Writes at most max_faces of them
+ * and returns the total number found. */
+uint32_t pmx_bvh_query_aabb(const PMXBVH *bvh, const PMXAABB *box, uint32_t *faces, uint32_t max_faces);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus 
+
+#endif // __PMX_BVH_H
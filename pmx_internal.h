@@ -0,0 +1,43 @@
+#ifndef __PMX_INTERNAL_H
+#define __PMX_INTERNAL_H
+
+#include "pmx_model.h"
+#include "pmx_layout.h"
+
+/* Shared between the library's translation units, not part of the public API. */
+
+#define PMX_INVALID_IDX UINT32_MAX
+
+void pmx_set_error_msg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Zero-filled; NULL when count is 0 or the allocator fails. */
+void *pmx_alloc(const PMXAllocator *allocator, size_t count, size_t size);
+void pmx_dealloc(const PMXAllocator *allocator, void *ptr, size_t count, size_t size);
+const PMXAllocator *pmx_default_allocator(void);
+
+void pmx_aabb_reset(PMXAABB *box);
+void pmx_aabb_extend(PMXAABB *box, const float pos[3]);
+
+/* Hands out size bytes at *cursor and advances it rounded up to align, a power
+ * of two. Run a layout once from 0 to size a block, then again from the block. */
+void *pmx_carve(uintptr_t *cursor, size_t size, size_t align);
+
+/* end == NULL parses without bounds checks; target may be NULL. */
+int pmx_parse_model(const char *src, const char *end, PMXModel *dst, const PMXAllocator *allocator, const PMXDecodeTarget *target);
+/* add_uv receives header->uv_count channels */
+const char *pmx_parse_vert_one(const char *src, const PMXHeader *header, PMXVert *dst, PMXFloat4 *add_uv);
+void pmx_vert_skin(const PMXVert *vert, uint32_t idx[4], float w[4]);
+const char *pmx_decode_vertices(const char *src, PMXModel *dst, const PMXDecodeTarget *target);
+const char *pmx_decode_faces(const char *src, PMXModel *dst, const PMXDecodeTarget *target);
+
+/* Sections are laid out in PMXSection order right after the header. */
+const char *pmx_parse_section(const char *src, PMXModel *dst, int section);
+const char *pmx_skim_section(const char *base, const char *src, const char *end, const PMXHeader *header, int section);
+int pmx_check_header(const PMXHeader *header);
+void pmx_free_section(PMXModel *model, int section);
+void pmx_compute_mat_bounds(PMXModel *model);
+
+/* Fast non-cryptographic hash used to detect changed sections. */
+uint64_t pmx_hash_range(const char *src, size_t size);
+
+#endif // __PMX_INTERNAL_H
@@ -0,0 +1,339 @@
+#include "pmx_layout.h"
+#include "pmx_internal.h"
+
+#include <math.h>
+
+static const uint8_t attrib_components[PMX_ATTRIB_COUNT] = {
+	3, 3, 2, 4, 4, 4, 4, 4, 4, 1, 3, 3, 3
+};
+
+static size_t format_size(uint8_t format)
+{
+	switch (format) {
+	case PMX_FORMAT_FLOAT32:
+	case PMX_FORMAT_UINT32:
+		return 4;
+	case PMX_FORMAT_FLOAT16:
+	case PMX_FORMAT_SNORM16:
+	case PMX_FORMAT_UNORM16:
+	case PMX_FORMAT_UINT16:
+		return 2;
+	case PMX_FORMAT_UNORM8:
+	case PMX_FORMAT_UINT8:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int is_uint_format(uint8_t format)
+{
+	return format == PMX_FORMAT_UINT8 || format == PMX_FORMAT_UINT16 || format == PMX_FORMAT_UINT32;
+}
+
+/* round to nearest even, overflow saturates to infinity */
+static uint16_t float_to_half(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+
+	uint16_t sign = (x >> 16) & 0x8000;
+	uint32_t exp = (x >> 23) & 0xff;
+	uint32_t mant = x & 0x7fffff;
+
+	if (exp == 0xff)
+		return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+	int e = (int)exp - 127 + 15;
+	if (e >= 31)
+		return sign | 0x7c00;
+
+	uint32_t shift = 13;
+	if (e <= 0) {
+		if (e < -10)
+			return sign;
+		mant |= 0x800000;
+		shift = 14 - e;
+		e = 0;
+	}
+
+	uint32_t half = ((uint32_t)e << 10) | (mant >> shift);
+	uint32_t rem = mant & ((1U << shift) - 1);
+	uint32_t mid = 1U << (shift - 1);
+	if (rem > mid || (rem == mid && (half & 1)))
+		++half;
+	return sign | half;
+}
+
+static float clampf(float x, float lo, float hi)
+{
+	return x < lo ? lo : (x > hi ? hi : x);
+}
+
+static void store_floats(uint8_t format, char *dst, const float *src, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		switch (format) {
+		case PMX_FORMAT_FLOAT32:
+			memcpy(dst + 4 * i, &src[i], 4);
+			break;
+		case PMX_FORMAT_FLOAT16: {
+			uint16_t h = float_to_half(src[i]);
+			memcpy(dst + 2 * i, &h, 2);
+			break;
+		}
+		case PMX_FORMAT_SNORM16: {
+			int16_t v = (int16_t)lrintf(clampf(src[i], -1.0f, 1.0f) * 32767.0f);
+			memcpy(dst + 2 * i, &v, 2);
+			break;
+		}
+		case PMX_FORMAT_UNORM16: {
+			uint16_t v = (uint16_t)lrintf(clampf(src[i], 0.0f, 1.0f) * 65535.0f);
+			memcpy(dst + 2 * i, &v, 2);
+			break;
+		}
+		case PMX_FORMAT_UNORM8:
+			dst[i] = (char)(uint8_t)lrintf(clampf(src[i], 0.0f, 1.0f) * 255.0f);
+			break;
+		}
+	}
+}
+
+static int store_indices(uint8_t format, char *dst, const uint32_t *src, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		switch (format) {
+		case PMX_FORMAT_UINT8:
+			if (src[i] > UINT8_MAX)
+				return -1;
+			dst[i] = (char)(uint8_t)src[i];
+			break;
+		case PMX_FORMAT_UINT16: {
+			if (src[i] > UINT16_MAX)
+				return -1;
+			uint16_t v = (uint16_t)src[i];
+			memcpy(dst + 2 * i, &v, 2);
+			break;
+		}
+		case PMX_FORMAT_UINT32:
+			memcpy(dst + 4 * i, &src[i], 4);
+			break;
+		}
+	}
+	return 0;
+}
+
+static int check_layout(const PMXVertexLayout *layout)
+{
+	for (int i = 0; i < PMX_ATTRIB_COUNT; ++i) {
+		const PMXVertexAttrib *attrib = &layout->attribs[i];
+		if (attrib->format == PMX_FORMAT_NONE)
+			continue;
+
+		size_t size = format_size(attrib->format);
+		int want_uint = i == PMX_ATTRIB_BONE_INDICES;
+		if (size == 0 || is_uint_format(attrib->format) != want_uint) {
+			pmx_set_error_msg("Invalid format %u for vertex attribute %d\n", attrib->format, i);
+			return -1;
+		}
+		if ((size_t)attrib->offset + size * attrib_components[i] > layout->stride) {
+			pmx_set_error_msg("Vertex attribute %d does not fit in stride %u\n", i, layout->stride);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_vertex(const PMXVertexLayout *layout, const int *active, int active_count,
+			char *dst, const PMXVert *vert, PMXFloat4 *add_uv, uint8_t uv_count)
+{
+	static const float zero[4] = { 0.0f };
+	uint32_t idx[4];
+	float w[4];
+
+	pmx_vert_skin(vert, idx, w);
+	for (int i = 0; i < active_count; ++i) {
+		int attrib = active[i];
+		const PMXVertexAttrib *desc = &layout->attribs[attrib];
+		char *out = dst + desc->offset;
+		const float *src = zero;
+
+		switch (attrib) {
+		case PMX_ATTRIB_POSITION:
+			src = vert->pos;
+			break;
+		case PMX_ATTRIB_NORMAL:
+			src = vert->normal;
+			break;
+		case PMX_ATTRIB_UV:
+			src = vert->uv;
+			break;
+		case PMX_ATTRIB_ADD_UV_1:
+		case PMX_ATTRIB_ADD_UV_2:
+		case PMX_ATTRIB_ADD_UV_3:
+		case PMX_ATTRIB_ADD_UV_4:
+			if (attrib - PMX_ATTRIB_ADD_UV_1 < uv_count)
+				src = add_uv[attrib - PMX_ATTRIB_ADD_UV_1];
+			break;
+		case PMX_ATTRIB_BONE_INDICES:
+			if (store_indices(desc->format, out, idx, 4)) {
+				pmx_set_error_msg("Bone index does not fit the index format\n");
+				return -1;
+			}
+			continue;
+		case PMX_ATTRIB_BONE_WEIGHTS:
+			src = w;
+			break;
+		case PMX_ATTRIB_EDGE_SCALE:
+			src = &vert->edge_scale;
+			break;
+		case PMX_ATTRIB_SDEF_C:
+			if (vert->weight_type == SDEF)
+				src = vert->weight.sdef.c;
+			break;
+		case PMX_ATTRIB_SDEF_R0:
+			if (vert->weight_type == SDEF)
+				src = vert->weight.sdef.r0;
+			break;
+		case PMX_ATTRIB_SDEF_R1:
+			if (vert->weight_type == SDEF)
+				src = vert->weight.sdef.r1;
+			break;
+		}
+		store_floats(desc->format, out, src, attrib_components[attrib]);
+	}
+	return 0;
+}
+
+const char *pmx_decode_vertices(const char *src, PMXModel *dst, const PMXDecodeTarget *target)
+{
+	const PMXHeader *header = &dst->header;
+	const PMXVertexLayout *layout = target->layout;
+	PMXFloat4 add_uv[PMX_MAX_ADD_UV];
+	int active[PMX_ATTRIB_COUNT];
+	int active_count = 0;
+	uint32_t count;
+
+	memcpy(&count, src, sizeof(count));
+	src += sizeof(count);
+	if (count > target->vertex_capacity) {
+		pmx_set_error_msg("Vertex buffer holds %zu vertices, model has %u\n", target->vertex_capacity, count);
+		return NULL;
+	}
+	dst->vertex_count = count;
+	dst->vertices = NULL;
+	memset(dst->add_uvs, 0, sizeof(dst->add_uvs));
+
+	for (int i = 0; i < PMX_ATTRIB_COUNT; ++i)
+		if (layout->attribs[i].format != PMX_FORMAT_NONE)
+			active[active_count++] = i;
+
+	char *out = target->vertices;
+	pmx_aabb_reset(&dst->bounds);
+	for (uint32_t i = 0; i < count; ++i) {
+		PMXVert vert;
+		src = pmx_parse_vert_one(src, header, &vert, add_uv);
+		if (!src)
+			return NULL;
+		pmx_aabb_extend(&dst->bounds, vert.pos);
+		if (write_vertex(layout, active, active_count, out + (size_t)i * layout->stride,
+				&vert, add_uv, header->uv_count))
+			return NULL;
+	}
+
+	return src;
+}
+
+const char *pmx_decode_faces(const char *src, PMXModel *dst, const PMXDecodeTarget *target)
+{
+	size_t idx_size = dst->header.vert_idx_size;
+	uint32_t count;
+
+	memcpy(&count, src, sizeof(count));
+	src += sizeof(count);
+	if (count > target->index_capacity) {
+		pmx_set_error_msg("Index buffer holds %zu indices, model has %u\n", target->index_capacity, count);
+		return NULL;
+	}
+	if (target->index_size == sizeof(uint16_t) && dst->vertex_count > UINT16_MAX + 1) {
+		pmx_set_error_msg("%u vertices do not fit 16-bit indices\n", dst->vertex_count);
+		return NULL;
+	}
+	dst->face_count = count / 3;
+	dst->faces = NULL;
+
+	uint16_t *out16 = target->indices;
+	uint32_t *out32 = target->indices;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t value = 0;
+		switch (idx_size) {
+		case 1:
+			value = *(uint8_t *)src;
+			break;
+		case 2:
+			value = *(uint16_t *)src;
+			break;
+		case 4:
+			value = *(uint32_t *)src;
+			break;
+		}
+		src += idx_size;
+
+		if (value >= dst->vertex_count) {
+			pmx_set_error_msg("Index %u references vertex %u of %u\n", i, value, dst->vertex_count);
+			return NULL;
+		}
+		if (target->index_size == sizeof(uint16_t))
+			out16[i] = (uint16_t)value;
+		else
+			out32[i] = value;
+	}
+
+	return src;
+}
+
+int pmx_peek_counts(const char *src, size_t len, uint32_t *vertex_count, uint32_t *index_count)
+{
+	const char *end = src + len;
+	PMXHeader header;
+
+	if (len < sizeof(header) || strncmp(src, "PMX ", 4)) {
+		pmx_set_error_msg("Not a pmx file\n");
+		return -1;
+	}
+	memcpy(&header, src, sizeof(header));
+	if (pmx_check_header(&header))
+		return -1;
+
+	const char *p = src + sizeof(header);
+	p = pmx_skim_section(src, p, end, &header, PMX_SECTION_INFO);
+	if (!p)
+		return -1;
+	if ((size_t)(end - p) < sizeof(uint32_t)) {
+		pmx_set_error_msg("Truncated vertices\n");
+		return -1;
+	}
+	memcpy(vertex_count, p, sizeof(uint32_t));
+
+	p = pmx_skim_section(src, p, end, &header, PMX_SECTION_VERTICES);
+	if (!p)
+		return -1;
+	if ((size_t)(end - p) < sizeof(uint32_t)) {
+		pmx_set_error_msg("Truncated faces\n");
+		return -1;
+	}
+	memcpy(index_count, p, sizeof(uint32_t));
+	return 0;
+}
+
+int pmx_parse_into(const char *src, size_t len, PMXModel *dst, const PMXAllocator *allocator, const PMXDecodeTarget *target)
+{
+	if (target->vertices && check_layout(target->layout))
+		return -1;
+	if (target->indices && target->index_size != sizeof(uint16_t) && target->index_size != sizeof(uint32_t)) {
+		pmx_set_error_msg("Invalid index size %u\n", target->index_size);
+		return -1;
+	}
+
+	return pmx_parse_model(src, src + len, dst, allocator ? allocator : pmx_default_allocator(), target);
+}
@@ -0,0 +1,84 @@
+#ifndef __PMX_LAYOUT_H
+#define __PMX_LAYOUT_H
+
+#include "pmx_model.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef enum
+{
+	PMX_FORMAT_NONE = 0,
+	PMX_FORMAT_FLOAT32,
+	PMX_FORMAT_FLOAT16,
+	PMX_FORMAT_SNORM16,
+	PMX_FORMAT_UNORM16,
+	PMX_FORMAT_UNORM8,
+	PMX_FORMAT_UINT8,
+	PMX_FORMAT_UINT16,
+	PMX_FORMAT_UINT32
+} PMXFormat;
+
+/* Component counts: position, normal, SDEF vectors 3; uv 2; additional UVs,
+ * bone indices and weights 4; edge scale 1. Bone indices take the UINT formats,
+ * everything else the float and normalized ones. Unused bone slots get index 0
+ * and weight 0; SDEF vertices export their two bones like BDEF2. BDEF4 weights
+ * are rescaled to sum to 1. */
+typedef enum
+{
+	PMX_ATTRIB_POSITION = 0,
+	PMX_ATTRIB_NORMAL,
+	PMX_ATTRIB_UV,
+	PMX_ATTRIB_ADD_UV_1,
+	PMX_ATTRIB_ADD_UV_2,
+	PMX_ATTRIB_ADD_UV_3,
+	PMX_ATTRIB_ADD_UV_4,
+	PMX_ATTRIB_BONE_INDICES,
+	PMX_ATTRIB_BONE_WEIGHTS,
+	PMX_ATTRIB_EDGE_SCALE,
+	PMX_ATTRIB_SDEF_C,
+	PMX_ATTRIB_SDEF_R0,
+	PMX_ATTRIB_SDEF_R1,
+	PMX_ATTRIB_COUNT
+} PMXAttrib;
+
+typedef struct
+{
+	uint8_t format;
+	uint32_t offset;
+} PMXVertexAttrib;
+
+/* Attributes left at PMX_FORMAT_NONE are not written. */
+typedef struct
+{
+	PMXVertexAttrib attribs[PMX_ATTRIB_COUNT];
+	uint32_t stride;
+} PMXVertexLayout;
+
+/* Destinations for the vertex and face sections, e.g. mapped staging memory.
+ * A NULL vertices or indices pointer decodes that section into the model as
+ * usual. index_size is 2 or 4. */
+typedef struct
+{
+	const PMXVertexLayout *layout;
+	void *vertices;
+	size_t vertex_capacity;
+	void *indices;
+	uint8_t index_size;
+	size_t index_capacity;
+} PMXDecodeTarget;
+
+/* Reads the vertex and index counts so destinations can be sized up front. */
+int pmx_peek_counts(const char *src, size_t len, uint32_t *vertex_count, uint32_t *index_count);
+
+/* Like pmx_parse_n, but decodes vertices and faces straight into target.
+ * Those sections are then left NULL in the model with their counts set,
+ * material bounds stay empty and model.bounds is still computed. */
+int pmx_parse_into(const char *src, size_t len, PMXModel *dst, const PMXAllocator *allocator, const PMXDecodeTarget *target);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus 
+
+#endif // __PMX_LAYOUT_H
@@ -0,0 +1,638 @@
+#include "pmx_lod.h"
+#include "pmx_internal.h"
+
+#include <math.h>
+
+/* border planes keep open edges in place relative to the surface planes */
+#define BORDER_WEIGHT 10.0
+/* half the L1 distance between two vertices' bone weights that still allows
+ * one to collapse onto the other */
+#define SKIN_TOLERANCE 0.25f
+#define MAX_PASSES 64
+
+#define VERTEX_LOCKED (1U << 0)
+#define VERTEX_BORDER (1U << 1)
+/* non-manifold in the current pass */
+#define VERTEX_PINNED (1U << 2)
+
+/* symmetric 4x4 plane quadric (xx xy xz xw yy yz yw zz zw ww) and its total weight */
+typedef struct
+{
+	double a[10];
+	double w;
+} Quadric;
+
+typedef struct
+{
+	double cost;
+	uint32_t u;
+	uint32_t v;
+} Candidate;
+
+typedef struct
+{
+	uint32_t index_count;
+	uint32_t *indices;
+	float error;
+} LevelPart;
+
+typedef struct
+{
+	const PMXModel *model;
+	uint32_t vertex_count;
+	uint32_t *global;
+	uint32_t (*bones)[4];
+	float (*weights)[4];
+	uint8_t *flags;
+	uint8_t *touched;
+	uint32_t *mark;
+	uint32_t stamp;
+	uint32_t *collapse;
+	Quadric *quadrics;
+	uint32_t tri_count;
+	uint32_t *tris;
+	double error;
+
+	/* per-pass topology: unique edges with their use counts, vertex to triangles */
+	uint32_t edge_count;
+	uint64_t *edges;
+	uint8_t *edge_uses;
+	uint32_t *adj_first;
+	uint32_t *adj;
+	Candidate *cands;
+} Simplifier;
+
+static const float *vertex_pos(const Simplifier *s, uint32_t v)
+{
+	return s->model->vertices[s->global[v]].pos;
+}
+
+static void quadric_add_plane(Quadric *q, const double n[3], double d, double w)
+{
+	q->a[0] += w * n[0] * n[0];
+	q->a[1] += w * n[0] * n[1];
+	q->a[2] += w * n[0] * n[2];
+	q->a[3] += w * n[0] * d;
+	q->a[4] += w * n[1] * n[1];
+	q->a[5] += w * n[1] * n[2];
+	q->a[6] += w * n[1] * d;
+	q->a[7] += w * n[2] * n[2];
+	q->a[8] += w * n[2] * d;
+	q->a[9] += w * d * d;
+	q->w += w;
+}
+
+static void quadric_add(Quadric *dst, const Quadric *src)
+{
+	for (size_t i = 0; i < 10; ++i)
+		dst->a[i] += src->a[i];
+	dst->w += src->w;
+}
+
+/* weighted mean squared distance of p to the quadric's planes */
+static double quadric_error(const Quadric *q, const float p[3])
+{
+	double x = p[0], y = p[1], z = p[2];
+	const double *a = q->a;
+	double e = a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+		 + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+		 + a[7] * z * z + 2 * a[8] * z + a[9];
+	return q->w > 0.0 ? fabs(e) / q->w : 0.0;
+}
+
+static void sub3(const float *a, const float *b, double out[3])
+{
+	for (size_t i = 0; i < 3; ++i)
+		out[i] = (double)a[i] - b[i];
+}
+
+static void cross3(const double a[3], const double b[3], double out[3])
+{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static double dot3(const double a[3], const double b[3])
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void tri_normal(const float *p0, const float *p1, const float *p2, double out[3])
+{
+	double e1[3], e2[3];
+	sub3(p1, p0, e1);
+	sub3(p2, p0, e2);
+	cross3(e1, e2, out);
+}
+
+static uint64_t edge_key(uint32_t a, uint32_t b)
+{
+	return a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_candidate(const void *a, const void *b)
+{
+	const Candidate *x = a, *y = b;
+	if (x->cost != y->cost)
+		return x->cost < y->cost ? -1 : 1;
+	if (x->u != y->u)
+		return x->u < y->u ? -1 : 1;
+	return x->v < y->v ? -1 : x->v > y->v;
+}
+
+static uint32_t edge_uses(const Simplifier *s, uint32_t a, uint32_t b)
+{
+	uint64_t key = edge_key(a, b);
+	const uint64_t *found = bsearch(&key, s->edges, s->edge_count, sizeof(uint64_t), cmp_u64);
+	return found ? s->edge_uses[found - s->edges] : 0;
+}
+
+static void build_topology(Simplifier *s)
+{
+	size_t n = 0;
+
+	for (size_t t = 0; t < s->tri_count; ++t)
+		for (size_t k = 0; k < 3; ++k)
+			s->edges[n++] = edge_key(s->tris[3 * t + k], s->tris[3 * t + (k + 1) % 3]);
+	qsort(s->edges, n, sizeof(uint64_t), cmp_u64);
+
+	for (size_t v = 0; v < s->vertex_count; ++v)
+		s->flags[v] &= VERTEX_LOCKED;
+
+	uint32_t unique = 0;
+	for (size_t i = 0; i < n;) {
+		size_t j = i;
+		while (j < n && s->edges[j] == s->edges[i])
+			++j;
+
+		uint32_t a = s->edges[i] >> 32, b = (uint32_t)s->edges[i];
+		uint8_t flag = j - i == 1 ? VERTEX_BORDER : (j - i > 2 ? VERTEX_PINNED : 0);
+		s->flags[a] |= flag;
+		s->flags[b] |= flag;
+		s->edges[unique] = s->edges[i];
+		s->edge_uses[unique++] = (uint8_t)MIN(j - i, UINT8_MAX);
+		i = j;
+	}
+	s->edge_count = unique;
+
+	memset(s->adj_first, 0, (s->vertex_count + 1) * sizeof(uint32_t));
+	for (size_t i = 0; i < 3 * (size_t)s->tri_count; ++i)
+		++s->adj_first[s->tris[i] + 1];
+	for (size_t v = 0; v < s->vertex_count; ++v)
+		s->adj_first[v + 1] += s->adj_first[v];
+	/* collapse doubles as the fill cursor, it is reset before use */
+	memcpy(s->collapse, s->adj_first, s->vertex_count * sizeof(uint32_t));
+	for (size_t i = 0; i < 3 * (size_t)s->tri_count; ++i)
+		s->adj[s->collapse[s->tris[i]]++] = i / 3;
+	for (size_t v = 0; v < s->vertex_count; ++v)
+		s->collapse[v] = v;
+}
+
+static void init_quadrics(Simplifier *s)
+{
+	memset(s->quadrics, 0, s->vertex_count * sizeof(Quadric));
+
+	for (size_t t = 0; t < s->tri_count; ++t) {
+		const uint32_t *tri = &s->tris[3 * t];
+		double n[3];
+		tri_normal(vertex_pos(s, tri[0]), vertex_pos(s, tri[1]), vertex_pos(s, tri[2]), n);
+		double len = sqrt(dot3(n, n));
+		if (len == 0.0)
+			continue;
+		for (size_t i = 0; i < 3; ++i)
+			n[i] /= len;
+
+		const float *p0 = vertex_pos(s, tri[0]);
+		double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+		for (size_t k = 0; k < 3; ++k)
+			quadric_add_plane(&s->quadrics[tri[k]], n, d, 0.5 * len);
+
+		/* a plane through each open edge, perpendicular to the face */
+		for (size_t k = 0; k < 3; ++k) {
+			uint32_t a = tri[k], b = tri[(k + 1) % 3];
+			if (edge_uses(s, a, b) != 1)
+				continue;
+
+			double e[3], pn[3];
+			sub3(vertex_pos(s, b), vertex_pos(s, a), e);
+			cross3(e, n, pn);
+			double plen = sqrt(dot3(pn, pn));
+			if (plen == 0.0)
+				continue;
+			for (size_t i = 0; i < 3; ++i)
+				pn[i] /= plen;
+
+			const float *pa = vertex_pos(s, a);
+			double pd = -(pn[0] * pa[0] + pn[1] * pa[1] + pn[2] * pa[2]);
+			quadric_add_plane(&s->quadrics[a], pn, pd, dot3(e, e) * BORDER_WEIGHT);
+			quadric_add_plane(&s->quadrics[b], pn, pd, dot3(e, e) * BORDER_WEIGHT);
+		}
+	}
+}
+
+static float bone_weight(const Simplifier *s, uint32_t v, uint32_t bone)
+{
+	float w = 0.0f;
+	for (size_t i = 0; i < 4; ++i)
+		if (s->bones[v][i] == bone)
+			w += s->weights[v][i];
+	return w;
+}
+
+static float skin_distance(const Simplifier *s, uint32_t a, uint32_t b)
+{
+	uint32_t bones[8];
+	size_t count = 0;
+	float d = 0.0f;
+
+	for (size_t i = 0; i < 8; ++i) {
+		uint32_t v = i < 4 ? a : b;
+		if (s->weights[v][i % 4] == 0.0f)
+			continue;
+		uint32_t bone = s->bones[v][i % 4];
+		size_t j = 0;
+		while (j < count && bones[j] != bone)
+			++j;
+		if (j == count)
+			bones[count++] = bone;
+	}
+	for (size_t i = 0; i < count; ++i)
+		d += fabsf(bone_weight(s, a, bones[i]) - bone_weight(s, b, bones[i]));
+	return 0.5f * d;
+}
+
+/* moving u onto v must not turn any of u's remaining triangles over */
+static int collapse_flips(const Simplifier *s, uint32_t u, uint32_t v)
+{
+	for (size_t k = s->adj_first[u]; k < s->adj_first[u + 1]; ++k) {
+		const uint32_t *tri = &s->tris[3 * s->adj[k]];
+		if (tri[0] == v || tri[1] == v || tri[2] == v)
+			continue;
+
+		const float *p[3], *q[3];
+		for (size_t i = 0; i < 3; ++i) {
+			p[i] = vertex_pos(s, tri[i]);
+			q[i] = tri[i] == u ? vertex_pos(s, v) : p[i];
+		}
+
+		double before[3], after[3];
+		tri_normal(p[0], p[1], p[2], before);
+		tri_normal(q[0], q[1], q[2], after);
+		if (dot3(before, after) <= 0.0)
+			return 1;
+	}
+	return 0;
+}
+
+/* u and v may only share the neighbours opposite their common triangles,
+ * otherwise the collapse pinches the surface into a non-manifold fold */
+static int collapse_pinches(Simplifier *s, uint32_t u, uint32_t v)
+{
+	uint32_t shared = 0, common = 0;
+
+	++s->stamp;
+	for (size_t k = s->adj_first[v]; k < s->adj_first[v + 1]; ++k) {
+		const uint32_t *tri = &s->tris[3 * s->adj[k]];
+		for (size_t i = 0; i < 3; ++i)
+			s->mark[tri[i]] = s->stamp;
+	}
+
+	for (size_t k = s->adj_first[u]; k < s->adj_first[u + 1]; ++k) {
+		const uint32_t *tri = &s->tris[3 * s->adj[k]];
+		int has_v = tri[0] == v || tri[1] == v || tri[2] == v;
+		shared += has_v;
+		for (size_t i = 0; i < 3; ++i) {
+			if (tri[i] == u || tri[i] == v || s->mark[tri[i]] != s->stamp)
+				continue;
+			/* count each common neighbour once */
+			s->mark[tri[i]] = s->stamp - 1;
+			++common;
+		}
+	}
+	return common != shared;
+}
+
+static size_t gather_candidates(Simplifier *s)
+{
+	size_t count = 0;
+
+	for (size_t e = 0; e < s->edge_count; ++e) {
+		uint32_t ends[2] = { s->edges[e] >> 32, (uint32_t)s->edges[e] };
+		for (size_t k = 0; k < 2; ++k) {
+			uint32_t u = ends[k], v = ends[1 - k];
+			if (s->flags[u] & (VERTEX_LOCKED | VERTEX_PINNED))
+				continue;
+			if ((s->flags[u] & VERTEX_BORDER) && s->edge_uses[e] != 1)
+				continue;
+			if (skin_distance(s, u, v) > SKIN_TOLERANCE)
+				continue;
+			/* v carries both quadrics after the collapse, so it is measured against both plane sets */
+			Quadric q = s->quadrics[u];
+			quadric_add(&q, &s->quadrics[v]);
+			s->cands[count++] = (Candidate){ quadric_error(&q, vertex_pos(s, v)), u, v };
+		}
+	}
+	qsort(s->cands, count, sizeof(Candidate), cmp_candidate);
+	return count;
+}
+
+static void simplify(Simplifier *s, uint32_t target)
+{
+	for (int pass = 0; pass < MAX_PASSES && s->tri_count > target; ++pass) {
+		build_topology(s);
+		size_t cand_count = gather_candidates(s);
+
+		/* independent collapses: a touched vertex neither moves nor is moved onto again this pass */
+		memset(s->touched, 0, s->vertex_count);
+		uint32_t tri_count = s->tri_count;
+		size_t collapsed = 0;
+		for (size_t c = 0; c < cand_count && tri_count > target; ++c) {
+			uint32_t u = s->cands[c].u, v = s->cands[c].v;
+			if (s->touched[u] || s->touched[v] || collapse_pinches(s, u, v) || collapse_flips(s, u, v))
+				continue;
+
+			for (size_t k = s->adj_first[u]; k < s->adj_first[u + 1]; ++k) {
+				const uint32_t *tri = &s->tris[3 * s->adj[k]];
+				if (tri[0] == v || tri[1] == v || tri[2] == v)
+					--tri_count;
+				s->touched[tri[0]] = s->touched[tri[1]] = s->touched[tri[2]] = 1;
+			}
+			s->touched[v] = 1;
+			s->collapse[u] = v;
+			quadric_add(&s->quadrics[v], &s->quadrics[u]);
+			s->error = MAX(s->error, s->cands[c].cost);
+			++collapsed;
+		}
+		if (collapsed == 0)
+			break;
+
+		uint32_t kept = 0;
+		for (size_t t = 0; t < s->tri_count; ++t) {
+			uint32_t a = s->collapse[s->tris[3 * t]];
+			uint32_t b = s->collapse[s->tris[3 * t + 1]];
+			uint32_t c = s->collapse[s->tris[3 * t + 2]];
+			if (a == b || b == c || c == a)
+				continue;
+			s->tris[3 * kept] = a;
+			s->tris[3 * kept + 1] = b;
+			s->tris[3 * kept + 2] = c;
+			++kept;
+		}
+		s->tri_count = kept;
+	}
+}
+
+static int simplify_material(const PMXModel *model, const uint32_t *indices, size_t index_count,
+			     const uint8_t *locked, uint32_t *remap, uint32_t level_count, float ratio, LevelPart *parts)
+{
+	Simplifier s = { .model = model };
+	size_t cap = MAX(index_count, 1);
+	int ret = -1;
+
+	s.global = malloc(cap * sizeof(uint32_t));
+	s.tris = malloc(cap * sizeof(uint32_t));
+	if (!s.global || !s.tris)
+		goto out;
+
+	for (size_t i = 0; i + 3 <= index_count; i += 3) {
+		const uint32_t *tri = &indices[i];
+		if (tri[0] >= model->vertex_count || tri[1] >= model->vertex_count || tri[2] >= model->vertex_count ||
+		    tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+			continue;
+		for (size_t k = 0; k < 3; ++k) {
+			if (remap[tri[k]] == PMX_INVALID_IDX) {
+				remap[tri[k]] = s.vertex_count;
+				s.global[s.vertex_count++] = tri[k];
+			}
+			s.tris[3 * s.tri_count + k] = remap[tri[k]];
+		}
+		++s.tri_count;
+	}
+
+	uint32_t n = s.vertex_count;
+	size_t edge_cap = MAX(3 * (size_t)s.tri_count, 1);
+	s.bones = malloc(MAX(n, 1) * sizeof(*s.bones));
+	s.weights = malloc(MAX(n, 1) * sizeof(*s.weights));
+	s.flags = malloc(MAX(n, 1));
+	s.touched = malloc(MAX(n, 1));
+	s.mark = calloc(MAX(n, 1), sizeof(uint32_t));
+	s.collapse = malloc(MAX(n, 1) * sizeof(uint32_t));
+	s.quadrics = malloc(MAX(n, 1) * sizeof(Quadric));
+	s.adj_first = malloc(((size_t)n + 1) * sizeof(uint32_t));
+	s.adj = malloc(edge_cap * sizeof(uint32_t));
+	s.edges = malloc(edge_cap * sizeof(uint64_t));
+	s.edge_uses = malloc(edge_cap);
+	s.cands = malloc(2 * edge_cap * sizeof(Candidate));
+	if (!s.bones || !s.weights || !s.flags || !s.touched || !s.mark || !s.collapse || !s.quadrics ||
+	    !s.adj_first || !s.adj || !s.edges || !s.edge_uses || !s.cands)
+		goto out;
+
+	for (size_t v = 0; v < n; ++v) {
+		pmx_vert_skin(&model->vertices[s.global[v]], s.bones[v], s.weights[v]);
+		s.flags[v] = locked[s.global[v]] ? VERTEX_LOCKED : 0;
+	}
+
+	build_topology(&s);
+	init_quadrics(&s);
+
+	uint32_t original = s.tri_count;
+	for (uint32_t level = 0; level < level_count; ++level) {
+		simplify(&s, (uint32_t)(original * pow(ratio, level + 1)));
+
+		LevelPart *part = &parts[level];
+		part->index_count = 3 * s.tri_count;
+		part->indices = malloc(MAX(part->index_count, 1) * sizeof(uint32_t));
+		if (!part->indices)
+			goto out;
+		for (size_t i = 0; i < part->index_count; ++i)
+			part->indices[i] = s.global[s.tris[i]];
+		part->error = (float)sqrt(s.error);
+	}
+	ret = 0;
+
+out:
+	/* remap is reused by the thread's next material */
+	for (size_t v = 0; v < s.vertex_count; ++v)
+		remap[s.global[v]] = PMX_INVALID_IDX;
+	free(s.cands);
+	free(s.edge_uses);
+	free(s.edges);
+	free(s.adj);
+	free(s.adj_first);
+	free(s.quadrics);
+	free(s.collapse);
+	free(s.mark);
+	free(s.touched);
+	free(s.flags);
+	free(s.weights);
+	free(s.bones);
+	free(s.tris);
+	free(s.global);
+	return ret;
+}
+
+typedef struct
+{
+	float pos[3];
+	uint32_t idx;
+} PosKey;
+
+static int cmp_pos(const void *a, const void *b)
+{
+	return memcmp(((const PosKey *)a)->pos, ((const PosKey *)b)->pos, sizeof(float[3]));
+}
+
+/* seams share a position with another vertex; material boundaries share the vertex itself */
+static uint8_t *find_locked(const PMXModel *model, const uint32_t *mat_first)
+{
+	uint32_t n = model->vertex_count;
+	uint8_t *locked = calloc(MAX(n, 1), 1);
+	uint32_t *owner = malloc(MAX(n, 1) * sizeof(uint32_t));
+	PosKey *keys = malloc(MAX(n, 1) * sizeof(PosKey));
+	const uint32_t *indices = (const uint32_t *)model->faces;
+	if (!locked || !owner || !keys) {
+		free(keys);
+		free(owner);
+		free(locked);
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < n; ++i) {
+		memcpy(keys[i].pos, model->vertices[i].pos, sizeof(keys[i].pos));
+		keys[i].idx = i;
+	}
+	qsort(keys, n, sizeof(PosKey), cmp_pos);
+	for (uint32_t i = 1; i < n; ++i) {
+		if (!cmp_pos(&keys[i - 1], &keys[i]))
+			locked[keys[i - 1].idx] = locked[keys[i].idx] = 1;
+	}
+
+	memset(owner, 0xff, MAX(n, 1) * sizeof(uint32_t));
+	for (uint32_t m = 0; m < model->material_count; ++m) {
+		for (size_t i = mat_first[m]; i < mat_first[m + 1]; ++i) {
+			uint32_t v = indices[i];
+			if (v >= n)
+				continue;
+			if (owner[v] == PMX_INVALID_IDX)
+				owner[v] = m;
+			else if (owner[v] != m)
+				locked[v] = 1;
+		}
+	}
+
+	free(keys);
+	free(owner);
+	return locked;
+}
+
+int pmx_build_lod_chain(const PMXModel *model, uint32_t level_count, float ratio, PMXLODChain *dst)
+{
+	uint32_t mat_count = model->material_count;
+	size_t index_count = (size_t)model->face_count * 3;
+
+	memset(dst, 0, sizeof(*dst));
+	if ((model->vertex_count && !model->vertices) || (index_count && !model->faces)) {
+		pmx_set_error_msg("LODs need vertices and faces decoded into the model\n");
+		return -1;
+	}
+	if (!(ratio > 0.0f && ratio < 1.0f)) {
+		pmx_set_error_msg("LOD ratio must be between 0 and 1\n");
+		return -1;
+	}
+
+	uint32_t *mat_first = malloc((mat_count + 1) * sizeof(uint32_t));
+	LevelPart *parts = calloc(MAX((size_t)mat_count * level_count, 1), sizeof(LevelPart));
+	uint8_t *locked = NULL;
+	int ret = -1;
+	if (!mat_first || !parts)
+		goto out;
+	mat_first[0] = 0;
+	for (uint32_t m = 0; m < mat_count; ++m)
+		mat_first[m + 1] = MIN(mat_first[m] + model->materials[m].face_count / 3 * 3, index_count);
+
+	locked = find_locked(model, mat_first);
+	if (!locked)
+		goto out;
+
+	int failed = 0;
+	#pragma omp parallel
+	{
+		uint32_t *remap = malloc(MAX(model->vertex_count, 1) * sizeof(uint32_t));
+		if (remap)
+			memset(remap, 0xff, MAX(model->vertex_count, 1) * sizeof(uint32_t));
+
+		/* every thread has to reach the loop, so a missing remap fails its materials instead */
+		#pragma omp for schedule(dynamic)
+		for (uint32_t m = 0; m < mat_count; ++m) {
+			if (!remap || simplify_material(model, (const uint32_t *)model->faces + mat_first[m],
+							 mat_first[m + 1] - mat_first[m], locked, remap, level_count,
+							 ratio, &parts[(size_t)m * level_count])) {
+				#pragma omp atomic write
+				failed = 1;
+			}
+		}
+
+		free(remap);
+	}
+	if (failed)
+		goto out;
+
+	dst->levels = calloc(MAX(level_count, 1), sizeof(PMXLODLevel));
+	if (!dst->levels)
+		goto out;
+	dst->level_count = level_count;
+	for (uint32_t l = 0; l < level_count; ++l) {
+		PMXLODLevel *level = &dst->levels[l];
+		level->mat_first = malloc((mat_count + 1) * sizeof(uint32_t));
+		if (!level->mat_first)
+			goto out;
+
+		level->mat_first[0] = 0;
+		for (uint32_t m = 0; m < mat_count; ++m)
+			level->mat_first[m + 1] = level->mat_first[m] + parts[(size_t)m * level_count + l].index_count;
+		level->index_count = level->mat_first[mat_count];
+		level->indices = malloc(MAX(level->index_count, 1) * sizeof(uint32_t));
+		if (!level->indices)
+			goto out;
+
+		for (uint32_t m = 0; m < mat_count; ++m) {
+			LevelPart *part = &parts[(size_t)m * level_count + l];
+			memcpy(level->indices + level->mat_first[m], part->indices, part->index_count * sizeof(uint32_t));
+			level->error = MAX(level->error, part->error);
+			free(part->indices);
+			part->indices = NULL;
+		}
+		TRACE("LOD %u: %u indices, error %g\n", l, level->index_count, level->error);
+	}
+	ret = 0;
+
+out:
+	if (parts)
+		for (size_t i = 0; i < (size_t)mat_count * level_count; ++i)
+			free(parts[i].indices);
+	free(locked);
+	free(parts);
+	free(mat_first);
+	if (ret) {
+		pmx_free_lod_chain(dst);
+		pmx_set_error_msg("Out of memory for LOD chain\n");
+	}
+	return ret;
+}
+
+void pmx_free_lod_chain(PMXLODChain *chain)
+{
+	for (uint32_t l = 0; l < chain->level_count; ++l) {
+		free(chain->levels[l].indices);
+		free(chain->levels[l].mat_first);
+	}
+	free(chain->levels);
+	memset(chain, 0, sizeof(*chain));
+}
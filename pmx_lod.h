@@ -0,0 +1,42 @@
+#ifndef __PMX_LOD_H
+#define __PMX_LOD_H
+
+#include "pmx_model.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/* Indices into the model's vertices, grouped by material like the model's
+ * faces: material i draws indices[mat_first[i], mat_first[i + 1]).
+ * error is the largest deviation from the original surface, in model units,
+ * accepted by any material at this level. */
+typedef struct
+{
+	uint32_t index_count;
+	uint32_t *indices;
+	uint32_t *mat_first;
+	float error;
+} PMXLODLevel;
+
+typedef struct
+{
+	uint32_t level_count;
+	PMXLODLevel *levels;
+} PMXLODChain;
+
+/* Level i keeps about ratio^(i + 1) of each material's triangles, continuing
+ * from level i - 1. Simplification collapses edges onto existing vertices by
+ * quadric error, so all levels share the model's vertex buffer. Vertices on
+ * UV seams or shared by several materials never move, open borders only
+ * slide along themselves, and a vertex only collapses onto one with similar
+ * bone weights. Weld the model first so exact duplicates are not taken for
+ * seams. Materials are simplified in parallel when built with OpenMP. */
+int pmx_build_lod_chain(const PMXModel *model, uint32_t level_count, float ratio, PMXLODChain *dst);
+void pmx_free_lod_chain(PMXLODChain *chain);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // __PMX_LOD_H
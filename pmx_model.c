@@ -1,7 +1,69 @@
 #include "pmx_model.h"
+#include "pmx_internal.h"
+#include "pmx_layout.h"
+
+#include <stdarg.h>
+#include <float.h>
 
 static char error_msg[ERROR_MSG_LEN];
 
+static void *default_alloc(size_t size, void *user)
+{
+	(void)user;
+	return malloc(size);
+}
+
+static void default_free(void *ptr, size_t size, void *user)
+{
+	(void)size;
+	(void)user;
+	free(ptr);
+}
+
+static PMXAllocator default_allocator = { default_alloc, default_free, NULL };
+
+void pmx_set_error_msg(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(error_msg, ERROR_MSG_LEN, fmt, args);
+	va_end(args);
+}
+
+const PMXAllocator *pmx_default_allocator(void)
+{
+	return &default_allocator;
+}
+
+void pmx_set_default_allocator(const PMXAllocator *allocator)
+{
+	if (allocator) {
+		default_allocator = *allocator;
+	} else {
+		default_allocator.alloc = default_alloc;
+		default_allocator.free = default_free;
+		default_allocator.user = NULL;
+	}
+}
+
+void *pmx_alloc(const PMXAllocator *allocator, size_t count, size_t size)
+{
+	if (count == 0 || size == 0 || count > SIZE_MAX / size)
+		return NULL;
+
+	void *ptr = allocator->alloc(count * size, allocator->user);
+	if (ptr)
+		memset(ptr, 0, count * size);
+	return ptr;
+}
+
+void pmx_dealloc(const PMXAllocator *allocator, void *ptr, size_t count, size_t size)
+{
+	if (ptr)
+		allocator->free(ptr, count * size, allocator->user);
+}
+
 static const char *get_field(const char *src, void *dst, size_t src_size, size_t count)
 {
 	for (size_t i = 0; i < count; ++i) {
@@ -30,76 +92,182 @@ static const char *get_field(const char *src, void *dst, size_t src_size, size_t
 static const char *get_field2(const char *src, void *dst, size_t src_size, size_t dst_size, size_t count) 
 {
 	for (size_t i = 0; i < count; ++i) {
+		/* widen through a zeroed value so narrow fields never leave stale upper bytes */
+		uint32_t value = 0;
 		switch (src_size) {
 		case 1:
-			*(uint8_t *)dst = *(uint8_t *)src;
+			value = *(uint8_t *)src;
 			src += 1;
 			break;
 		case 2: 
-			*(uint16_t *)dst = *(uint16_t *)src;
+			value = *(uint16_t *)src;
 			src += 2;
 			break;
 		case 4:
-			*(uint32_t *)dst = *(uint32_t *)src;
+			value = *(uint32_t *)src;
 			src += 4;
 			break;
 		}
+		memcpy(dst, &value, MIN(dst_size, sizeof(value)));
 		dst += dst_size;
 	}
 
 	return src;
 }
 
-static const char *get_text(const char *src, PMXText *dst)
+/* dst must start zeroed; a NULL src is passed through so callers check once */
+static const char *get_text(const char *src, PMXText *dst, const PMXAllocator *allocator)
 {
 	uint32_t len;
 
+	if (!src)
+		return NULL;
 	src = get_field(src, &len, sizeof(uint32_t), 1);
 	dst->len = len;
 	memcpy(dst->text, src, MIN(len, MAX_TEXT_LEN));
+	if (len > MAX_TEXT_LEN) {
+		dst->full = pmx_alloc(allocator, len, 1);
+		if (!dst->full)
+			return NULL;
+		memcpy(dst->full, src, len);
+	}
 	src += len;
 	return src;
 }
 
-static const char *pmx_parse_info(const char *src, PMXInfo *dst)
+static void free_text(const PMXAllocator *allocator, PMXText *text)
 {
-	src = get_text(src, &dst->name_jp);
-       	src = get_text(src, &dst->name_en);
-	src = get_text(src, &dst->comm_jp);
-	src = get_text(src, &dst->comm_en);
+	pmx_dealloc(allocator, text->full, text->len, 1);
+	text->full = NULL;
+}
+
+static size_t text_usage(const PMXText *text)
+{
+	return text->full ? text->len : 0;
+}
+
+const char *pmx_text_data(const PMXText *text)
+{
+	return text->full ? text->full : text->text;
+}
+
+static const char *pmx_parse_info(const char *src, PMXInfo *dst, const PMXAllocator *allocator)
+{
+	src = get_text(src, &dst->name_jp, allocator);
+	src = get_text(src, &dst->name_en, allocator);
+	src = get_text(src, &dst->comm_jp, allocator);
+	src = get_text(src, &dst->comm_en, allocator);
 	return src;
 }
 
-static const char *pmx_parse_vert(const char *src, const PMXHeader *header, PMXVert *dst, size_t count)
+void pmx_aabb_reset(PMXAABB *box)
 {
-	for (size_t i = 0; i < count; ++i) {
-		src = get_field(src, &dst[i].pos, sizeof(float), 3);
-	       	src = get_field(src, &dst[i].normal, sizeof(float), 3);	
-		src = get_field(src, &dst[i].uv, sizeof(float), 2);
-		src = get_field(src, &dst[i].weight_type, sizeof(uint8_t), 1);
+	for (size_t i = 0; i < 3; ++i) {
+		box->min[i] = FLT_MAX;
+		box->max[i] = -FLT_MAX;
+	}
+}
 
-		size_t idx_size = header->bone_idx_size;
-		switch (dst[i].weight_type) {
-			case BDEF1:
-				src = get_field2(src, &dst[i].weight.bdef1.idx0, idx_size, sizeof(uint32_t), 1); 
-				break;
-			case BDEF2:
-				src = get_field2(src, &dst[i].weight.bdef2.idx0, idx_size, sizeof(uint32_t), 2);
-				src = get_field(src, &dst[i].weight.bdef2.w0, sizeof(float), 1); 
-				break;
-			case BDEF4:
-				src = get_field2(src, dst[i].weight.bdef4.idx, idx_size, sizeof(uint32_t), 4);
-				src = get_field(src, dst[i].weight.bdef4.w, sizeof(float), 4);
-				break;
-			case SDEF:
-				src = get_field2(src, &dst[i].weight.sdef.idx0, idx_size, sizeof(uint32_t), 2);
-				src = get_field(src, &dst[i].weight.sdef.w0, sizeof(float), 1);
-				src = get_field(src, &dst[i].weight.sdef.c, sizeof(float), 9);
-				break;
-			default:
-				return NULL;
+void pmx_aabb_extend(PMXAABB *box, const float pos[3])
+{
+	for (size_t i = 0; i < 3; ++i) {
+		box->min[i] = MIN(box->min[i], pos[i]);
+		box->max[i] = MAX(box->max[i], pos[i]);
+	}
+}
+
+void *pmx_carve(uintptr_t *cursor, size_t size, size_t align)
+{
+	void *p = (void *)*cursor;
+	*cursor += (size + align - 1) & ~(align - 1);
+	return p;
+}
+
+const char *pmx_parse_vert_one(const char *src, const PMXHeader *header, PMXVert *dst, PMXFloat4 *add_uv)
+{
+	src = get_field(src, &dst->pos, sizeof(float), 3);
+	src = get_field(src, &dst->normal, sizeof(float), 3);	
+	src = get_field(src, &dst->uv, sizeof(float), 2);
+	for (size_t j = 0; j < header->uv_count; ++j)
+		src = get_field(src, add_uv[j], sizeof(float), 4);
+	src = get_field(src, &dst->weight_type, sizeof(uint8_t), 1);
+
+	size_t idx_size = header->bone_idx_size;
+	switch (dst->weight_type) {
+		case BDEF1:
+			src = get_field2(src, &dst->weight.bdef1.idx0, idx_size, sizeof(uint32_t), 1); 
+			break;
+		case BDEF2:
+			src = get_field2(src, &dst->weight.bdef2.idx0, idx_size, sizeof(uint32_t), 2);
+			src = get_field(src, &dst->weight.bdef2.w0, sizeof(float), 1); 
+			break;
+		case BDEF4:
+			src = get_field2(src, dst->weight.bdef4.idx, idx_size, sizeof(uint32_t), 4);
+			src = get_field(src, dst->weight.bdef4.w, sizeof(float), 4);
+			break;
+		case SDEF:
+			src = get_field2(src, &dst->weight.sdef.idx0, idx_size, sizeof(uint32_t), 2);
+			src = get_field(src, &dst->weight.sdef.w0, sizeof(float), 1);
+			src = get_field(src, &dst->weight.sdef.c, sizeof(float), 9);
+			break;
+		default:
+			return NULL;
+	}
+	return get_field(src, &dst->edge_scale, sizeof(float), 1);	
+}
+
+/* expands any weight type into four bone/weight pairs, unused slots are 0/0 */
+void pmx_vert_skin(const PMXVert *vert, uint32_t idx[4], float w[4])
+{
+	memset(idx, 0, 4 * sizeof(uint32_t));
+	memset(w, 0, 4 * sizeof(float));
+
+	switch (vert->weight_type) {
+	case BDEF1:
+		idx[0] = vert->weight.bdef1.idx0;
+		w[0] = 1.0f;
+		break;
+	case BDEF2:
+		idx[0] = vert->weight.bdef2.idx0;
+		idx[1] = vert->weight.bdef2.idx1;
+		w[0] = vert->weight.bdef2.w0;
+		w[1] = 1.0f - w[0];
+		break;
+	case BDEF4: {
+		/* weights are stored as raw float bits */
+		memcpy(idx, vert->weight.bdef4.idx, 4 * sizeof(uint32_t));
+		memcpy(w, vert->weight.bdef4.w, 4 * sizeof(float));
+		float sum = w[0] + w[1] + w[2] + w[3];
+		for (size_t i = 0; i < 4; ++i) {
+			if (w[i] == 0.0f)
+				idx[i] = 0;
+			/* editors do not enforce a sum of 1 */
+			else if (sum > 0.0f)
+				w[i] /= sum;
 		}
-		src = get_field(src, &dst[i].edge_scale, sizeof(float), 1);	
+		break;
+	}
+	case SDEF:
+		idx[0] = vert->weight.sdef.idx0;
+		idx[1] = vert->weight.sdef.idx1;
+		w[0] = vert->weight.sdef.w0;
+		w[1] = 1.0f - w[0];
+		break;
+	}
+}
+
+static const char *pmx_parse_vert(const char *src, const PMXHeader *header, PMXVert *dst, PMXFloat4 **add_uvs, size_t count, PMXAABB *bounds)
+{
+	PMXFloat4 add_uv[PMX_MAX_ADD_UV];
+
+	pmx_aabb_reset(bounds);
+	for (size_t i = 0; i < count; ++i) {
+		src = pmx_parse_vert_one(src, header, &dst[i], add_uv);
+		if (!src)
+			return NULL;
+		pmx_aabb_extend(bounds, dst[i].pos);
+		for (size_t j = 0; j < header->uv_count; ++j)
+			memcpy(add_uvs[j][i], add_uv[j], sizeof(PMXFloat4));
 	}
 
 	return src;
@@ -112,18 +280,20 @@ static const char *pmx_parse_face(const char *src, const PMXHeader *header, PMXF
 	return src;
 }
 
-static const char *pmx_parse_tex(const char* src, PMXTex *dst, size_t count)
+static const char *pmx_parse_tex(const char* src, PMXTex *dst, size_t count, const PMXAllocator *allocator)
 {
 	for (size_t i = 0; i < count; ++i) 
-		src = get_text(src, &dst[i].name);
+		src = get_text(src, &dst[i].name, allocator);
 	return src;
 }
 
-static const char *pmx_parse_mat(const char *src, const PMXHeader *header, PMXMat *dst, size_t count)
+static const char *pmx_parse_mat(const char *src, const PMXHeader *header, PMXMat *dst, size_t count, const PMXAllocator *allocator)
 {
 	for (size_t i = 0; i < count; ++i) {
-		src = get_text(src, &dst[i].name_jp);
-		src = get_text(src, &dst[i].name_en);
+		src = get_text(src, &dst[i].name_jp, allocator);
+		src = get_text(src, &dst[i].name_en, allocator);
+		if (!src)
+			return NULL;
 		src = get_field(src, dst[i].diffuse, sizeof(float), 4);
 		src = get_field(src, dst[i].specular, sizeof(float), 3);
 		src = get_field(src, &dst[i].power, sizeof(float), 1);
@@ -137,13 +307,37 @@ static const char *pmx_parse_mat(const char *src, const PMXHeader *header, PMXMa
 	        src = get_field(src, &dst[i].toon_mode, sizeof(uint8_t), 1);
 		src = get_field2(src, &dst[i].toon_idx, 
 			dst[i].toon_mode == TOON_TEX ? header->tex_idx_size : 1, sizeof(uint32_t), 1);
-		src = get_text(src, &dst[i].memo);
+		src = get_text(src, &dst[i].memo, allocator);
+		if (!src)
+			return NULL;
 		src = get_field(src, &dst[i].face_count, sizeof(uint32_t), 1);
 	}
 
 	return src;
 }
 
+/* faces precede materials in the file, so material bounds are filled in once both are read */
+void pmx_compute_mat_bounds(PMXModel *model)
+{
+	const uint32_t *indices = (const uint32_t *)model->faces;
+	size_t index_count = (size_t)model->face_count * 3;
+	size_t first = 0;
+
+	for (size_t i = 0; i < model->material_count; ++i) {
+		PMXMat *mat = &model->materials[i];
+		size_t last = MIN(first + mat->face_count, index_count);
+
+		pmx_aabb_reset(&mat->bounds);
+		/* left empty when vertices or faces were decoded into caller buffers */
+		if (!model->vertices || !model->faces)
+			continue;
+		for (size_t j = first; j < last; ++j)
+			if (indices[j] < model->vertex_count)
+				pmx_aabb_extend(&mat->bounds, model->vertices[indices[j]].pos);
+		first = last;
+	}
+}
+
 static const char *pmx_parse_ik(const char *src, const PMXHeader *header, PMXIKLink *dst, size_t count)
 {
 	for (size_t i = 0; i < count; ++i) {
@@ -158,11 +352,13 @@ static const char *pmx_parse_ik(const char *src, const PMXHeader *header, PMXIKL
 	return src;
 }
 
-static const char *pmx_parse_bone(const char *src, const PMXHeader *header, PMXBone *dst, size_t count)
+static const char *pmx_parse_bone(const char *src, const PMXHeader *header, PMXBone *dst, size_t count, const PMXAllocator *allocator)
 {
 	for (size_t i = 0; i < count; ++i) {
-		src = get_text(src, &dst[i].name_jp);
-		src = get_text(src, &dst[i].name_en);
+		src = get_text(src, &dst[i].name_jp, allocator);
+		src = get_text(src, &dst[i].name_en, allocator);
+		if (!src)
+			return NULL;
 		src = get_field(src, dst[i].pos, sizeof(float), 3);
 		src = get_field2(src, &dst[i].parent, header->bone_idx_size, sizeof(uint32_t), 1);
 		src = get_field(src, &dst[i].transform_layer, sizeof(uint32_t), 1);
@@ -198,7 +394,9 @@ static const char *pmx_parse_bone(const char *src, const PMXHeader *header, PMXB
 			
 			size_t link_count = dst[i].ik.link_count;
 			if (link_count > 0) {
-				dst[i].ik.links = calloc(link_count, sizeof(PMXIKLink));
+				dst[i].ik.links = pmx_alloc(allocator, link_count, sizeof(PMXIKLink));
+				if (!dst[i].ik.links)
+					return NULL;
 				src = pmx_parse_ik(src, header, dst[i].ik.links, link_count);
 			}
 		}	
@@ -213,8 +411,8 @@ static const char *pmx_parse_morph_offset(const char *src, const PMXHeader *head
 		switch (type) {
 			case MORPH_TYPE_GROUP:
 			case MORPH_TYPE_FLIP:
-				src = get_field2(src, &dst[i].group_flip.idx, header->rb_idx_size, sizeof(uint32_t), 1);
-				src = get_field(src, &dst[i].group_flip.rate, sizeof(uint8_t), 1);
+				src = get_field2(src, &dst[i].group_flip.idx, header->morph_idx_size, sizeof(uint32_t), 1);
+				src = get_field(src, &dst[i].group_flip.rate, sizeof(float), 1);
 				break;
 			case MORPH_TYPE_VERTEX:
 				src = get_field2(src, &dst[i].vertex.idx, header->vert_idx_size, sizeof(uint32_t), 1);
@@ -260,18 +458,22 @@ static const char *pmx_parse_morph_offset(const char *src, const PMXHeader *head
 	return src;
 }
 
-static const char *pmx_parse_morph(const char *src, const PMXHeader *header, PMXMorph *dst, size_t count)
+static const char *pmx_parse_morph(const char *src, const PMXHeader *header, PMXMorph *dst, size_t count, const PMXAllocator *allocator)
 {
 	for (size_t i = 0; i < count; ++i) {
-		src = get_text(src, &dst[i].name_jp);
-		src = get_text(src, &dst[i].name_en);
+		src = get_text(src, &dst[i].name_jp, allocator);
+		src = get_text(src, &dst[i].name_en, allocator);
+		if (!src)
+			return NULL;
 		src = get_field(src, &dst[i].panel, sizeof(uint8_t), 1);
 		src = get_field(src, &dst[i].type, sizeof(uint8_t), 1);
 		src = get_field(src, &dst[i].offset_count, sizeof(uint32_t), 1);
 		uint32_t offset_count = dst[i].offset_count;
+		dst[i].offset_capacity = offset_count;
 		if (offset_count > 0) {
-			dst[i].offsets = malloc(offset_count * sizeof(PMXMorphOffset));
-			assert(dst[i].offsets);
+			dst[i].offsets = pmx_alloc(allocator, offset_count, sizeof(PMXMorphOffset));
+			if (!dst[i].offsets)
+				return NULL;
 			src = pmx_parse_morph_offset(src, header, dst[i].offsets, dst[i].type, dst[i].offset_count);	
 		}	
 	}
@@ -298,17 +500,20 @@ static const char *pmx_parse_frame_elem(const char *src, const PMXHeader *header
 	return src;
 }
 
-static const char *pmx_parse_frame(const char *src, const PMXHeader *header, PMXFrame *dst, size_t count)
+static const char *pmx_parse_frame(const char *src, const PMXHeader *header, PMXFrame *dst, size_t count, const PMXAllocator *allocator)
 {
 	for (size_t i = 0; i < count; ++i) {
-		src = get_text(src, &dst[i].name_jp);
-		src = get_text(src, &dst[i].name_en);
+		src = get_text(src, &dst[i].name_jp, allocator);
+		src = get_text(src, &dst[i].name_en, allocator);
+		if (!src)
+			return NULL;
 		src = get_field(src, &dst[i].special, sizeof(uint8_t), 1);
 		src = get_field(src, &dst[i].elem_count, sizeof(uint32_t), 1);
 		uint32_t elem_count = dst[i].elem_count;
 		if (elem_count > 0) {
-			dst[i].elems = malloc(elem_count * sizeof(PMXFrameElement));
-			assert(dst[i].elems);
+			dst[i].elems = pmx_alloc(allocator, elem_count, sizeof(PMXFrameElement));
+			if (!dst[i].elems)
+				return NULL;
 			src = pmx_parse_frame_elem(src, header, dst[i].elems, elem_count);
 		}
 	}
@@ -316,11 +521,13 @@ static const char *pmx_parse_frame(const char *src, const PMXHeader *header, PMX
 	return src;
 }
 
-static const char *pmx_parse_rigidbody(const char *src, const PMXHeader *header, PMXRigidBody *dst, size_t count)
+static const char *pmx_parse_rigidbody(const char *src, const PMXHeader *header, PMXRigidBody *dst, size_t count, const PMXAllocator *allocator)
 {
 	for (size_t i = 0; i < count; ++i) {
-		src = get_text(src, &dst[i].name_jp);
-		src = get_text(src, &dst[i].name_en);
+		src = get_text(src, &dst[i].name_jp, allocator);
+		src = get_text(src, &dst[i].name_en, allocator);
+		if (!src)
+			return NULL;
 		src = get_field2(src, &dst[i].bone_idx, header->bone_idx_size, sizeof(uint32_t), 1);
 		src = get_field(src, &dst[i].group, sizeof(uint8_t), 1);
 		src = get_field(src, &dst[i].no_collide_group, sizeof(uint16_t), 1);
@@ -339,11 +546,13 @@ static const char *pmx_parse_rigidbody(const char *src, const PMXHeader *header,
 	return src;
 }
 
-static const char *pmx_parse_joint(const char *src, const PMXHeader *header, PMXJoint *dst, size_t count)
+static const char *pmx_parse_joint(const char *src, const PMXHeader *header, PMXJoint *dst, size_t count, const PMXAllocator *allocator)
 {
 	for (size_t i = 0; i < count; ++i) {
-		src = get_text(src, &dst[i].name_jp);
-		src = get_text(src, &dst[i].name_en);
+		src = get_text(src, &dst[i].name_jp, allocator);
+		src = get_text(src, &dst[i].name_en, allocator);
+		if (!src)
+			return NULL;
 		src = get_field(src, &dst[i].type, sizeof(uint8_t), 1);
 		src = get_field2(src, &dst[i].idx1, header->rb_idx_size, sizeof(uint32_t), 1);
 		src = get_field2(src, &dst[i].idx2, header->rb_idx_size, sizeof(uint32_t), 1);
@@ -360,22 +569,353 @@ static const char *pmx_parse_joint(const char *src, const PMXHeader *header, PMX
 	return src;
 }
 
-int pmx_parse(const char *src, PMXModel *dst)
+static const char *section_names[PMX_SECTION_COUNT] = {
+	"info", "vertices", "faces", "textures", "materials",
+	"bones", "morphs", "frames", "rigidbodies", "joints"
+};
+
+static size_t morph_offset_size(const PMXHeader *header, uint8_t type)
 {
+	switch (type) {
+	case MORPH_TYPE_GROUP:
+	case MORPH_TYPE_FLIP:
+		return header->morph_idx_size + sizeof(float);
+	case MORPH_TYPE_VERTEX:
+		return header->vert_idx_size + 3 * sizeof(float);
+	case MORPH_TYPE_BONE:
+		return header->bone_idx_size + 7 * sizeof(float);
+	case MORPH_TYPE_UV:
+	case MORPH_TYPE_ADD_UV_1:
+	case MORPH_TYPE_ADD_UV_2:
+	case MORPH_TYPE_ADD_UV_3:
+	case MORPH_TYPE_ADD_UV_4:
+		return header->vert_idx_size + 4 * sizeof(float);
+	case MORPH_TYPE_MATERIAL:
+		return header->mat_idx_size + 1 + 28 * sizeof(float);
+	case MORPH_TYPE_IMPULSE:
+		return header->rb_idx_size + 1 + 6 * sizeof(float);
+	default:
+		return 0;
+	}
+}
+
+/* Walks a section without decoding it and returns its end. Every length,
+ * count and tag the decoders will later trust is checked against end here,
+ * so the decode loops themselves need no bounds checks. */
+const char *pmx_skim_section(const char *base, const char *src, const char *end, const PMXHeader *header, int section)
+{
+	size_t bone = header->bone_idx_size;
+	size_t tex = header->tex_idx_size;
+	size_t i = 0;
+	uint32_t count, len;
+	uint8_t tag;
+
+#define SKIM(n) \
+	do { \
+		if ((size_t)(end - src) < (size_t)(n)) \
+			goto overrun; \
+		src += (n); \
+	} while (0)
+#define SKIM_FIELD(field) \
+	do { \
+		if ((size_t)(end - src) < sizeof(field)) \
+			goto overrun; \
+		src = get_field(src, &(field), sizeof(field), 1); \
+	} while (0)
+#define SKIM_TEXT() \
+	do { \
+		SKIM_FIELD(len); \
+		SKIM(len); \
+	} while (0)
+
+	if (section == PMX_SECTION_INFO) {
+		for (; i < 4; ++i)
+			SKIM_TEXT();
+		return src;
+	}
+
+	SKIM_FIELD(count);
+	if (section == PMX_SECTION_FACES) {
+		if (count % 3) {
+			pmx_set_error_msg("Invalid %s: %u indices do not form whole triangles\n",
+				section_names[section], count);
+			return NULL;
+		}
+		/* faces are fixed size, skip the whole index array at once */
+		if ((size_t)(end - src) / header->vert_idx_size < count)
+			goto overrun;
+		return src + (size_t)count * header->vert_idx_size;
+	}
+
+	for (; i < count; ++i) {
+		switch (section) {
+		case PMX_SECTION_VERTICES:
+			SKIM(8 * sizeof(float) + header->uv_count * 4 * sizeof(float));
+			SKIM_FIELD(tag);
+			switch (tag) {
+			case BDEF1:
+				SKIM(bone);
+				break;
+			case BDEF2:
+				SKIM(2 * bone + sizeof(float));
+				break;
+			case BDEF4:
+				SKIM(4 * bone + 4 * sizeof(float));
+				break;
+			case SDEF:
+				SKIM(2 * bone + 10 * sizeof(float));
+				break;
+			default:
+				goto bad_tag;
+			}
+			SKIM(sizeof(float));
+			break;
+		case PMX_SECTION_TEXTURES:
+			SKIM_TEXT();
+			break;
+		case PMX_SECTION_MATERIALS:
+			SKIM_TEXT();
+			SKIM_TEXT();
+			SKIM(16 * sizeof(float) + 1 + 2 * tex + 1);
+			SKIM_FIELD(tag);
+			SKIM(tag == TOON_TEX ? tex : 1);
+			SKIM_TEXT();
+			SKIM(sizeof(uint32_t));
+			break;
+		case PMX_SECTION_BONES: {
+			uint16_t flags;
+			SKIM_TEXT();
+			SKIM_TEXT();
+			SKIM(3 * sizeof(float) + bone + sizeof(uint32_t));
+			SKIM_FIELD(flags);
+			SKIM(flags & BONE_FLAG_CONNECTED ? bone : 3 * sizeof(float));
+			if (flags & BONE_FLAG_LINK_ROTATION || flags & BONE_FLAG_LINK_MOVE)
+				SKIM(bone + sizeof(float));
+			if (flags & BONE_FLAG_FIXED_AXIS)
+				SKIM(3 * sizeof(float));
+			if (flags & BONE_FLAG_LOCAL_AXIS)
+				SKIM(6 * sizeof(float));
+			if (flags & BONE_FLAG_EXT_PARENT_TRANSFORM)
+				SKIM(sizeof(uint32_t));
+			if (flags & BONE_FLAG_IK) {
+				uint32_t link_count;
+				SKIM(bone + sizeof(uint32_t) + sizeof(float));
+				SKIM_FIELD(link_count);
+				for (size_t j = 0; j < link_count; ++j) {
+					SKIM(bone);
+					SKIM_FIELD(tag);
+					if (tag)
+						SKIM(6 * sizeof(float));
+				}
+			}
+			break;
+		}
+		case PMX_SECTION_MORPHS: {
+			uint32_t offset_count;
+			SKIM_TEXT();
+			SKIM_TEXT();
+			SKIM(1);
+			SKIM_FIELD(tag);
+			SKIM_FIELD(offset_count);
+			size_t size = morph_offset_size(header, tag);
+			if (size == 0)
+				goto bad_tag;
+			if ((size_t)(end - src) / size < offset_count)
+				goto overrun;
+			src += offset_count * size;
+			break;
+		}
+		case PMX_SECTION_FRAMES: {
+			uint32_t elem_count;
+			SKIM_TEXT();
+			SKIM_TEXT();
+			SKIM(1);
+			SKIM_FIELD(elem_count);
+			for (size_t j = 0; j < elem_count; ++j) {
+				SKIM_FIELD(tag);
+				if (tag == FRAME_ELEM_TYPE_BONE)
+					SKIM(bone);
+				else if (tag == FRAME_ELEM_TYPE_MORPH)
+					SKIM(header->morph_idx_size);
+				else
+					goto bad_tag;
+			}
+			break;
+		}
+		case PMX_SECTION_RIGIDBODIES:
+			SKIM_TEXT();
+			SKIM_TEXT();
+			SKIM(bone + 4 + 14 * sizeof(float) + 1);
+			break;
+		case PMX_SECTION_JOINTS:
+			SKIM_TEXT();
+			SKIM_TEXT();
+			SKIM(1 + 2 * header->rb_idx_size + 24 * sizeof(float));
+			break;
+		default:
+			return NULL;
+		}
+	}
+
+	return src;
+
+#undef SKIM_TEXT
+#undef SKIM_FIELD
+#undef SKIM
+
+overrun:
+	pmx_set_error_msg("Truncated %s: element %zu overruns the input at byte %zu\n",
+		section_names[section], i, (size_t)(src - base));
+	return NULL;
+bad_tag:
+	pmx_set_error_msg("Invalid %s: element %zu has unknown type %u near byte %zu\n",
+		section_names[section], i, tag, (size_t)(src - base));
+	return NULL;
+}
+
+#define PARSE_ARRAY(field, count, type, parse, ...) \
+	do { \
+		src = get_field(src, &dst->count, sizeof(dst->count), 1); \
+		TRACE("%s count: %u\n", section_names[section], dst->count); \
+		dst->field = pmx_alloc(&dst->allocator, dst->count, sizeof(type)); \
+		if (!dst->field && dst->count > 0) { \
+			pmx_set_error_msg("Out of memory for %s\n", section_names[section]); \
+			return NULL; \
+		} \
+		src = parse(src, __VA_ARGS__); \
+	} while (0)
+
+const char *pmx_parse_section(const char *src, PMXModel *dst, int section)
+{
+	const PMXHeader *header = &dst->header;
+
+	switch (section) {
+	case PMX_SECTION_INFO:
+		memset(&dst->info, 0, sizeof(dst->info));
+		src = pmx_parse_info(src, &dst->info, &dst->allocator);
+		break;
+	case PMX_SECTION_VERTICES:
+		src = get_field(src, &dst->vertex_count, sizeof(dst->vertex_count), 1);
+		TRACE("Vertex count: %u\n", dst->vertex_count);
+		dst->vertices = pmx_alloc(&dst->allocator, dst->vertex_count, sizeof(PMXVert));
+		int oom = !dst->vertices;
+		/* additional UVs only get streams for the channels the file has */
+		for (size_t i = 0; i < PMX_MAX_ADD_UV; ++i) {
+			dst->add_uvs[i] = NULL;
+			if (i < header->uv_count) {
+				dst->add_uvs[i] = pmx_alloc(&dst->allocator, dst->vertex_count, sizeof(PMXFloat4));
+				oom |= !dst->add_uvs[i];
+			}
+		}
+		if (oom && dst->vertex_count > 0) {
+			pmx_set_error_msg("Out of memory for vertices\n");
+			return NULL;
+		}
+		src = pmx_parse_vert(src, header, dst->vertices, dst->add_uvs, dst->vertex_count, &dst->bounds);
+		break;
+	case PMX_SECTION_FACES:
+		/* stored as an index count */
+		src = get_field(src, &dst->face_count, sizeof(dst->face_count), 1);
+		dst->face_count /= 3;
+		TRACE("Face count: %u\n", dst->face_count);
+		dst->faces = pmx_alloc(&dst->allocator, dst->face_count, sizeof(PMXFace));
+		if (!dst->faces && dst->face_count > 0) {
+			pmx_set_error_msg("Out of memory for faces\n");
+			return NULL;
+		}
+		src = pmx_parse_face(src, header, dst->faces, dst->face_count);
+		break;
+	case PMX_SECTION_TEXTURES:
+		PARSE_ARRAY(textures, texture_count, PMXTex, pmx_parse_tex,
+			dst->textures, dst->texture_count, &dst->allocator);
+		break;
+	case PMX_SECTION_MATERIALS:
+		PARSE_ARRAY(materials, material_count, PMXMat, pmx_parse_mat,
+			header, dst->materials, dst->material_count, &dst->allocator);
+		break;
+	case PMX_SECTION_BONES:
+		PARSE_ARRAY(bones, bone_count, PMXBone, pmx_parse_bone,
+			header, dst->bones, dst->bone_count, &dst->allocator);
+		break;
+	case PMX_SECTION_MORPHS:
+		PARSE_ARRAY(morphs, morph_count, PMXMorph, pmx_parse_morph,
+			header, dst->morphs, dst->morph_count, &dst->allocator);
+		break;
+	case PMX_SECTION_FRAMES:
+		PARSE_ARRAY(frames, frame_count, PMXFrame, pmx_parse_frame,
+			header, dst->frames, dst->frame_count, &dst->allocator);
+		break;
+	case PMX_SECTION_RIGIDBODIES:
+		PARSE_ARRAY(rigidbodies, rigidbody_count, PMXRigidBody, pmx_parse_rigidbody,
+			header, dst->rigidbodies, dst->rigidbody_count, &dst->allocator);
+		break;
+	case PMX_SECTION_JOINTS:
+		PARSE_ARRAY(joints, joint_count, PMXJoint, pmx_parse_joint,
+			header, dst->joints, dst->joint_count, &dst->allocator);
+		break;
+	default:
+		return NULL;
+	}
+
+	if (!src)
+		pmx_set_error_msg("Failed to parse %s\n", section_names[section]);
+	return src;
+}
+
+#undef PARSE_ARRAY
+
+int pmx_check_header(const PMXHeader *header)
+{
+	const uint8_t sizes[] = {
+		header->vert_idx_size, header->tex_idx_size, header->mat_idx_size,
+		header->bone_idx_size, header->morph_idx_size, header->rb_idx_size
+	};
+
+	for (size_t i = 0; i < sizeof(sizes); ++i) {
+		if (sizes[i] != 1 && sizes[i] != 2 && sizes[i] != 4) {
+			pmx_set_error_msg("Invalid index size %u in header\n", sizes[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* With end set, a bounded skim validates every section's extent before
+ * anything is decoded, so the decoders run without per-field checks. */
+int pmx_parse_model(const char *src, const char *end, PMXModel *dst, const PMXAllocator *allocator, const PMXDecodeTarget *target)
+{
+	const char *base = src;
+	const char *extent[PMX_SECTION_COUNT + 1];
+
 	TRACE(" ********** PMX Parser **********\n");
+	if (end && (size_t)(end - src) < sizeof(dst->header)) {
+		snprintf(error_msg, ERROR_MSG_LEN, "Truncated header\n");
+		return -1;
+	}
 	if (strncmp(src, "PMX ", 4)) {
 		snprintf(error_msg, ERROR_MSG_LEN, "Not a pmx file\n");
 		return -1;
 	}
 	memcpy(&dst->header, src, sizeof(dst->header));
-	if (dst->header.uv_count > 0) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Additional UV is unsupported\n");
+	if (dst->header.uv_count > PMX_MAX_ADD_UV) {
+		snprintf(error_msg, ERROR_MSG_LEN, "Invalid additional UV count %u\n", dst->header.uv_count);
 		return -1;
 	}
+	if (pmx_check_header(&dst->header))
+		return -1;
 	src += sizeof(dst->header);
-	src = pmx_parse_info(src, &dst->info);
+
+	if (end) {
+		extent[0] = src;
+		for (int i = 0; i < PMX_SECTION_COUNT; ++i) {
+			extent[i + 1] = pmx_skim_section(base, extent[i], end, &dst->header, i);
+			if (!extent[i + 1])
+				return -1;
+		}
+	}
 
 	dst->vertices = NULL;
+	memset(dst->add_uvs, 0, sizeof(dst->add_uvs));
 	dst->faces = NULL;
 	dst->textures = NULL;
 	dst->materials = NULL;
@@ -384,148 +924,234 @@ int pmx_parse(const char *src, PMXModel *dst)
 	dst->frames = NULL;
 	dst->rigidbodies = NULL;
 	dst->joints = NULL;
+	dst->allocator = *allocator;
+	memset(dst->section_hash, 0, sizeof(dst->section_hash));
 
-	src = get_field(src, &dst->vertex_count, sizeof(dst->vertex_count), 1);
-	TRACE("Vertex count: %u\n", dst->vertex_count);
-	dst->vertices = calloc(dst->vertex_count, sizeof(PMXVert));
-	src = pmx_parse_vert(src, &dst->header, dst->vertices, dst->vertex_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse vertices\n");
-		return -1;
-	}
-
-	src = get_field(src, &dst->face_count, sizeof(dst->face_count), 1);
-	dst->face_count /= 3;
-	TRACE("Face count: %u\n", dst->face_count);
-	dst->faces = calloc(dst->face_count, sizeof(PMXFace));
-	src = pmx_parse_face(src, &dst->header, dst->faces, dst->face_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse faces\n");
-		return -1;
-	}
-
-	src = get_field(src, &dst->texture_count, sizeof(dst->texture_count), 1);
-	TRACE("Texture count: %u\n", dst->texture_count);
-	dst->textures = calloc(dst->texture_count, sizeof(PMXTex));
-	src = pmx_parse_tex(src, dst->textures, dst->texture_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse textures\n");
-		return -1;
-	}
-
-	src = get_field(src, &dst->material_count, sizeof(dst->material_count), 1);
-	TRACE("Material count: %u\n", dst->material_count);
-	dst->materials= calloc(dst->material_count, sizeof(PMXMat));
-	src = pmx_parse_mat(src, &dst->header, dst->materials, dst->material_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse materials\n");
-		return -1;
+	for (int i = 0; i < PMX_SECTION_COUNT; ++i) {
+		if (target && target->vertices && i == PMX_SECTION_VERTICES)
+			src = pmx_decode_vertices(src, dst, target);
+		else if (target && target->indices && i == PMX_SECTION_FACES)
+			src = pmx_decode_faces(src, dst, target);
+		else
+			src = pmx_parse_section(src, dst, i);
+		if (src && end && src != extent[i + 1]) {
+			pmx_set_error_msg("Decoded %s past the validated extent\n", section_names[i]);
+			src = NULL;
+		}
+		if (!src) {
+			pmx_free(dst);
+			return -1;
+		}
 	}
+	pmx_compute_mat_bounds(dst);
 	
-	src = get_field(src, &dst->bone_count, sizeof(dst->bone_count), 1);
-	TRACE("Bone count: %u\n", dst->bone_count);
-	dst->bones = calloc(dst->bone_count, sizeof(PMXBone));
-	src = pmx_parse_bone(src, &dst->header, dst->bones, dst->bone_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse bones\n");
-		return -1;
-	}
+	TRACE(" ********** Parse OK **********\n");
+	return 0;
+}
 
-	src = get_field(src, &dst->morph_count, sizeof(dst->morph_count), 1);
-	TRACE("Morph count: %u\n", dst->morph_count);
-	dst->morphs = calloc(dst->morph_count, sizeof(PMXMorph));
-	src = pmx_parse_morph(src, &dst->header, dst->morphs, dst->morph_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse bones\n");
-		return -1;
-	}
+int pmx_parse(const char *src, PMXModel *dst)
+{
+	return pmx_parse_model(src, NULL, dst, &default_allocator, NULL);
+}
 
-	src = get_field(src, &dst->frame_count, sizeof(dst->frame_count), 1);
-	TRACE("Frame count: %u\n", dst->frame_count);
-	dst->frames = calloc(dst->frame_count, sizeof(PMXFrame));
-	src = pmx_parse_frame(src, &dst->header, dst->frames, dst->frame_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse frames\n");
-		return -1;
-	}
+int pmx_parse_alloc(const char *src, PMXModel *dst, const PMXAllocator *allocator)
+{
+	return pmx_parse_model(src, NULL, dst, allocator ? allocator : &default_allocator, NULL);
+}
 
-	src = get_field(src, &dst->rigidbody_count, sizeof(dst->rigidbody_count), 1);
-	TRACE("Rigidbody count: %u\n", dst->rigidbody_count);
-	dst->rigidbodies = calloc(dst->rigidbody_count, sizeof(PMXRigidBody));
-	src = pmx_parse_rigidbody(src, &dst->header, dst->rigidbodies, dst->rigidbody_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse rigidbodies\n");
-		return -1;
-	}
+int pmx_parse_n(const char *src, size_t len, PMXModel *dst, const PMXAllocator *allocator)
+{
+	return pmx_parse_model(src, src + len, dst, allocator ? allocator : &default_allocator, NULL);
+}
 
-	src = get_field(src, &dst->joint_count, sizeof(dst->joint_count), 1);
-	TRACE("Joint count: %u\n", dst->joint_count);
-	dst->joints = calloc(dst->joint_count, sizeof(PMXJoint));
-	src = pmx_parse_joint(src, &dst->header, dst->joints, dst->joint_count);
-	if (!src) {
-		snprintf(error_msg, ERROR_MSG_LEN, "Failed to parse joints\n");
-		return -1;
+void pmx_free_section(PMXModel *model, int section)
+{
+	const PMXAllocator *allocator = &model->allocator;
+
+	switch (section) {
+	case PMX_SECTION_INFO:
+		free_text(allocator, &model->info.name_jp);
+		free_text(allocator, &model->info.name_en);
+		free_text(allocator, &model->info.comm_jp);
+		free_text(allocator, &model->info.comm_en);
+		break;
+	case PMX_SECTION_VERTICES:
+		pmx_dealloc(allocator, model->vertices, model->vertex_count, sizeof(PMXVert));
+		model->vertices = NULL;
+		for (size_t i = 0; i < PMX_MAX_ADD_UV; ++i) {
+			pmx_dealloc(allocator, model->add_uvs[i], model->vertex_count, sizeof(PMXFloat4));
+			model->add_uvs[i] = NULL;
+		}
+		break;
+	case PMX_SECTION_FACES:
+		pmx_dealloc(allocator, model->faces, model->face_count, sizeof(PMXFace));
+		model->faces = NULL;
+		break;
+	case PMX_SECTION_TEXTURES:
+		if (model->textures) {
+			for (size_t i = 0; i < model->texture_count; ++i)
+				free_text(allocator, &model->textures[i].name);
+			pmx_dealloc(allocator, model->textures, model->texture_count, sizeof(PMXTex));
+			model->textures = NULL;
+		}
+		break;
+	case PMX_SECTION_MATERIALS:
+		if (model->materials) {
+			for (size_t i = 0; i < model->material_count; ++i) {
+				free_text(allocator, &model->materials[i].name_jp);
+				free_text(allocator, &model->materials[i].name_en);
+				free_text(allocator, &model->materials[i].memo);
+			}
+			pmx_dealloc(allocator, model->materials, model->material_count, sizeof(PMXMat));
+			model->materials = NULL;
+		}
+		break;
+	case PMX_SECTION_BONES:
+		if (model->bones) {
+			for (size_t i = 0; i < model->bone_count; ++i) {
+				free_text(allocator, &model->bones[i].name_jp);
+				free_text(allocator, &model->bones[i].name_en);
+				pmx_dealloc(allocator, model->bones[i].ik.links,
+					model->bones[i].ik.link_count, sizeof(PMXIKLink));
+			}
+			pmx_dealloc(allocator, model->bones, model->bone_count, sizeof(PMXBone));
+			model->bones = NULL;
+		}
+		break;
+	case PMX_SECTION_MORPHS:
+		if (model->morphs) {
+			for (size_t i = 0; i < model->morph_count; ++i) {
+				free_text(allocator, &model->morphs[i].name_jp);
+				free_text(allocator, &model->morphs[i].name_en);
+				pmx_dealloc(allocator, model->morphs[i].offsets,
+					model->morphs[i].offset_capacity, sizeof(PMXMorphOffset));
+			}
+			pmx_dealloc(allocator, model->morphs, model->morph_count, sizeof(PMXMorph));
+			model->morphs = NULL;
+		}
+		break;
+	case PMX_SECTION_FRAMES:
+		if (model->frames) {
+			for (size_t i = 0; i < model->frame_count; ++i) {
+				free_text(allocator, &model->frames[i].name_jp);
+				free_text(allocator, &model->frames[i].name_en);
+				pmx_dealloc(allocator, model->frames[i].elems,
+					model->frames[i].elem_count, sizeof(PMXFrameElement));
+			}
+			pmx_dealloc(allocator, model->frames, model->frame_count, sizeof(PMXFrame));
+			model->frames = NULL;
+		}
+		break;
+	case PMX_SECTION_RIGIDBODIES:
+		if (model->rigidbodies) {
+			for (size_t i = 0; i < model->rigidbody_count; ++i) {
+				free_text(allocator, &model->rigidbodies[i].name_jp);
+				free_text(allocator, &model->rigidbodies[i].name_en);
+			}
+			pmx_dealloc(allocator, model->rigidbodies, model->rigidbody_count, sizeof(PMXRigidBody));
+			model->rigidbodies = NULL;
+		}
+		break;
+	case PMX_SECTION_JOINTS:
+		if (model->joints) {
+			for (size_t i = 0; i < model->joint_count; ++i) {
+				free_text(allocator, &model->joints[i].name_jp);
+				free_text(allocator, &model->joints[i].name_en);
+			}
+			pmx_dealloc(allocator, model->joints, model->joint_count, sizeof(PMXJoint));
+			model->joints = NULL;
+		}
+		break;
 	}
-	
-	TRACE(" ********** Parse OK **********\n");
-	return 0;
 }
 
 void pmx_free(PMXModel *model)
 {
-	if (model->vertices) {
-		free(model->vertices);
-		model->vertices = NULL;
-	}
+	for (int i = 0; i < PMX_SECTION_COUNT; ++i)
+		pmx_free_section(model, i);
+}
 
-	if (model->faces) {
-		free(model->faces);
-		model->faces = NULL;
-	}
+size_t pmx_model_memory_usage(const PMXModel *model, PMXMemoryUsage *usage)
+{
+	PMXMemoryUsage u;
+
+	memset(&u, 0, sizeof(u));
+	u.info = text_usage(&model->info.name_jp) + text_usage(&model->info.name_en) +
+		text_usage(&model->info.comm_jp) + text_usage(&model->info.comm_en);
+	if (model->vertices)
+		u.vertices = model->vertex_count * sizeof(PMXVert);
+	for (size_t i = 0; i < PMX_MAX_ADD_UV; ++i)
+		if (model->add_uvs[i])
+			u.vertices += model->vertex_count * sizeof(PMXFloat4);
+	if (model->faces)
+		u.faces = model->face_count * sizeof(PMXFace);
 
 	if (model->textures) {
-		free(model->textures);
-		model->textures = NULL;
+		u.textures = model->texture_count * sizeof(PMXTex);
+		for (size_t i = 0; i < model->texture_count; ++i)
+			u.textures += text_usage(&model->textures[i].name);
 	}
 
 	if (model->materials) {
-		free(model->materials);
-		model->materials = NULL;
+		u.materials = model->material_count * sizeof(PMXMat);
+		for (size_t i = 0; i < model->material_count; ++i)
+			u.materials += text_usage(&model->materials[i].name_jp) +
+				text_usage(&model->materials[i].name_en) +
+				text_usage(&model->materials[i].memo);
 	}
-	
+
 	if (model->bones) {
-		for (size_t i = 0; i < model->bone_count; ++i)
+		u.bones = model->bone_count * sizeof(PMXBone);
+		for (size_t i = 0; i < model->bone_count; ++i) {
+			u.bones += text_usage(&model->bones[i].name_jp) + text_usage(&model->bones[i].name_en);
 			if (model->bones[i].ik.links)
-				free(model->bones[i].ik.links);
-		free(model->bones);
-		model->bones = NULL;
+				u.bones += model->bones[i].ik.link_count * sizeof(PMXIKLink);
+		}
 	}
 
 	if (model->morphs) {
-		for (size_t i = 0; i < model->morph_count; ++i)
+		u.morphs = model->morph_count * sizeof(PMXMorph);
+		for (size_t i = 0; i < model->morph_count; ++i) {
+			u.morphs += text_usage(&model->morphs[i].name_jp) + text_usage(&model->morphs[i].name_en);
 			if (model->morphs[i].offsets)
-				free(model->morphs[i].offsets);
-		free(model->morphs);
-		model->morphs = NULL;
+				u.morphs += model->morphs[i].offset_capacity * sizeof(PMXMorphOffset);
+		}
 	}
 
 	if (model->frames) {
-		for (size_t i = 0; i < model->frame_count; ++i)
+		u.frames = model->frame_count * sizeof(PMXFrame);
+		for (size_t i = 0; i < model->frame_count; ++i) {
+			u.frames += text_usage(&model->frames[i].name_jp) + text_usage(&model->frames[i].name_en);
 			if (model->frames[i].elems)
-				free(model->frames[i].elems);
-		free(model->frames);
-		model->frames = NULL;
+				u.frames += model->frames[i].elem_count * sizeof(PMXFrameElement);
+		}
 	}
 
 	if (model->rigidbodies) {
-		free(model->rigidbodies);
-		model->rigidbodies = NULL;
+		u.rigidbodies = model->rigidbody_count * sizeof(PMXRigidBody);
+		for (size_t i = 0; i < model->rigidbody_count; ++i)
+			u.rigidbodies += text_usage(&model->rigidbodies[i].name_jp) +
+				text_usage(&model->rigidbodies[i].name_en);
 	}
 
 	if (model->joints) {
-		free(model->joints);
-		model->joints = NULL;
+		u.joints = model->joint_count * sizeof(PMXJoint);
+		for (size_t i = 0; i < model->joint_count; ++i)
+			u.joints += text_usage(&model->joints[i].name_jp) + text_usage(&model->joints[i].name_en);
 	}
+
+	u.total = u.info + u.vertices + u.faces + u.textures + u.materials + u.bones +
+		u.morphs + u.frames + u.rigidbodies + u.joints;
+	if (usage)
+		*usage = u;
+	return u.total;
+}
+
+PMXFloat4 *pmx_morph_add_uv_stream(const PMXModel *model, const PMXMorph *morph)
+{
+	if (morph->type < MORPH_TYPE_ADD_UV_1 || morph->type > MORPH_TYPE_ADD_UV_4)
+		return NULL;
+	return model->add_uvs[morph->type - MORPH_TYPE_ADD_UV_1];
 }
 
 const char *pmx_get_error_msg(void)
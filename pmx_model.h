@@ -19,9 +19,14 @@
 #define MAX_TEXT_LEN 64
 #define ERROR_MSG_LEN 128
 
+#define PMX_MAX_ADD_UV 4
+
 #define TOON_TEX 0
 #define TOON_BUILTIN 1
 
+#define TEXT_ENC_UTF16 0
+#define TEXT_ENC_UTF8 1
+
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
@@ -41,10 +46,14 @@ typedef struct __attribute__((packed))
 	uint8_t rb_idx_size;
 } PMXHeader;
 
+/* text holds the first MAX_TEXT_LEN bytes; longer texts are also kept whole
+ * in full, allocated with the model's allocator. pmx_text_data picks the
+ * one holding all len bytes. */
 typedef struct 
 {
 	uint32_t len;
 	char text[MAX_TEXT_LEN];
+	char *full;
 } PMXText;
 
 typedef struct 
@@ -94,11 +103,20 @@ typedef struct
 	float edge_scale;
 } PMXVert;
 
+typedef float PMXFloat4[4];
+
 typedef struct 
 {
 	uint32_t indices[3];
 } PMXFace;
 
+/* Empty boxes have min > max. */
+typedef struct
+{
+	float min[3];
+	float max[3];
+} PMXAABB;
+
 typedef struct 
 {
 	PMXText name;
@@ -122,6 +140,7 @@ typedef struct
 	uint32_t toon_idx;
 	PMXText memo;
 	uint32_t face_count;
+	PMXAABB bounds;
 } PMXMat;
 
 typedef struct 
@@ -240,6 +259,7 @@ typedef struct
 	uint8_t panel;
 	uint8_t type;
 	uint32_t offset_count;
+	uint32_t offset_capacity;
 	PMXMorphOffset *offsets;
 } PMXMorph;
 
@@ -318,12 +338,58 @@ typedef struct
 	float spring_rot[3];
 } PMXJoint;
 
+typedef enum
+{
+	PMX_SECTION_INFO = 0,
+	PMX_SECTION_VERTICES,
+	PMX_SECTION_FACES,
+	PMX_SECTION_TEXTURES,
+	PMX_SECTION_MATERIALS,
+	PMX_SECTION_BONES,
+	PMX_SECTION_MORPHS,
+	PMX_SECTION_FRAMES,
+	PMX_SECTION_RIGIDBODIES,
+	PMX_SECTION_JOINTS,
+	PMX_SECTION_COUNT
+} PMXSection;
+
+#define PMX_SECTION_BIT(section) (1U << (section))
+#define PMX_SECTION_ALL ((1U << PMX_SECTION_COUNT) - 1)
+
+/* alloc must return memory aligned for any PMX struct, or NULL.
+ * free receives the size that was requested from alloc. */
+typedef struct
+{
+	void *(*alloc)(size_t size, void *user);
+	void (*free)(void *ptr, size_t size, void *user);
+	void *user;
+} PMXAllocator;
+
+/* Bytes held per section, including nested arrays such as IK links and
+ * texts longer than MAX_TEXT_LEN. */
+typedef struct
+{
+	size_t info;
+	size_t vertices;
+	size_t faces;
+	size_t textures;
+	size_t materials;
+	size_t bones;
+	size_t morphs;
+	size_t frames;
+	size_t rigidbodies;
+	size_t joints;
+	size_t total;
+} PMXMemoryUsage;
+
 typedef struct 
 {
 	PMXHeader header;
 	PMXInfo info;
 	uint32_t vertex_count;
 	PMXVert *vertices;
+	/* one stream per additional UV channel in the header, NULL past uv_count */
+	PMXFloat4 *add_uvs[PMX_MAX_ADD_UV];
 	uint32_t face_count;
 	PMXFace *faces;
 	uint32_t texture_count;
@@ -340,10 +406,39 @@ typedef struct
 	PMXRigidBody *rigidbodies;
 	uint32_t joint_count;
 	PMXJoint *joints;
+	PMXAABB bounds;
+	PMXAllocator allocator;
+	uint64_t section_hash[PMX_SECTION_COUNT];
 } PMXModel;
 
+/* pmx_parse uses the default allocator, which is malloc/free unless replaced,
+ * as does pmx_parse_alloc given NULL. A model keeps the allocator it was
+ * parsed with and is freed through it. */
 int pmx_parse(const char *src, PMXModel *dst);
+int pmx_parse_alloc(const char *src, PMXModel *dst, const PMXAllocator *allocator);
+/* Stream a MORPH_TYPE_ADD_UV_1..4 morph's offsets apply to, NULL for other
+ * morph types or channels the model does not have. */
+PMXFloat4 *pmx_morph_add_uv_stream(const PMXModel *model, const PMXMorph *morph);
+/* All len bytes of a text, not NUL-terminated. */
+const char *pmx_text_data(const PMXText *text);
+/* For untrusted input: never reads past src + len. A NULL allocator selects
+ * the default one. */
+int pmx_parse_n(const char *src, size_t len, PMXModel *dst, const PMXAllocator *allocator);
 void pmx_free(PMXModel *model);
+/* Re-decodes only the sections whose bytes differ from the ones last hashed,
+ * and reports them in changed as PMX_SECTION_BIT()s. Parsing does not hash, so
+ * the first reload re-decodes every section unless pmx_hash_sections was
+ * called on the parsed file; each reload records the hashes for the next. A
+ * header change reparses everything. On failure the model is left as it was.
+ * pmx_weld_vertices marks the sections it rewrites as changed; models edited
+ * any other way should be parsed afresh instead. */
+int pmx_reload(const char *src, size_t len, PMXModel *model, uint32_t *changed);
+/* Records the section hashes of the file model was parsed from, so the first
+ * pmx_reload only re-decodes what changed. */
+int pmx_hash_sections(const char *src, size_t len, PMXModel *model);
+/* NULL restores malloc/free */
+void pmx_set_default_allocator(const PMXAllocator *allocator);
+size_t pmx_model_memory_usage(const PMXModel *model, PMXMemoryUsage *usage);
 const char *pmx_get_error_msg(void);
 
 #ifdef __cplusplus
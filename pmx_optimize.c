@@ -0,0 +1,382 @@
+#include "pmx_optimize.h"
+#include "pmx_internal.h"
+
+#include <stddef.h>
+
+typedef struct
+{
+	uint32_t cls;
+	float offset[4];
+	uint32_t id;
+} MorphKey;
+
+static uint32_t hash_bytes(const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < size; ++i) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static uint32_t hash_vertex(const PMXModel *model, uint32_t v)
+{
+	uint32_t h = hash_bytes(&model->vertices[v], sizeof(PMXVert));
+
+	for (size_t i = 0; i < model->header.uv_count; ++i)
+		h = h * 31 + hash_bytes(model->add_uvs[i][v], sizeof(PMXFloat4));
+	return h;
+}
+
+static int vertex_equal(const PMXModel *model, uint32_t a, uint32_t b)
+{
+	if (memcmp(&model->vertices[a], &model->vertices[b], sizeof(PMXVert)))
+		return 0;
+	for (size_t i = 0; i < model->header.uv_count; ++i)
+		if (memcmp(model->add_uvs[i][a], model->add_uvs[i][b], sizeof(PMXFloat4)))
+			return 0;
+	return 1;
+}
+
+static size_t table_size(size_t count)
+{
+	size_t size = 16;
+
+	while (size < count * 2)
+		size <<= 1;
+	return size;
+}
+
+static int is_vertex_morph(uint8_t type)
+{
+	switch (type) {
+	case MORPH_TYPE_VERTEX:
+	case MORPH_TYPE_UV:
+	case MORPH_TYPE_ADD_UV_1:
+	case MORPH_TYPE_ADD_UV_2:
+	case MORPH_TYPE_ADD_UV_3:
+	case MORPH_TYPE_ADD_UV_4:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* vertex and uv offsets share the leading idx member */
+static uint32_t *morph_vertex_idx(PMXMorphOffset *offset)
+{
+	return &offset->vertex.idx;
+}
+
+static void morph_key(const PMXMorph *morph, const PMXMorphOffset *offset, uint32_t cls, MorphKey *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->cls = cls;
+	if (morph->type == MORPH_TYPE_VERTEX)
+		memcpy(key->offset, offset->vertex.offset, sizeof(offset->vertex.offset));
+	else
+		memcpy(key->offset, offset->uv.offset, sizeof(offset->uv.offset));
+}
+
+/* Splits every vertex class by the offset each morph applies to its members.
+ * Unreferenced vertices keep their class, referenced ones move to a fresh class
+ * shared only with vertices that had the same class and the same offset.
+ * Returns the next free class id, or PMX_INVALID_IDX when out of memory. */
+static uint32_t refine_by_morph(const PMXMorph *morph, uint32_t *cls, uint32_t next_id)
+{
+	size_t size = table_size(morph->offset_count);
+	MorphKey *table = malloc(size * sizeof(MorphKey));
+	if (!table)
+		return PMX_INVALID_IDX;
+	for (size_t i = 0; i < size; ++i)
+		table[i].cls = PMX_INVALID_IDX;
+
+	for (size_t i = 0; i < morph->offset_count; ++i) {
+		uint32_t v = *morph_vertex_idx(&morph->offsets[i]);
+		MorphKey key;
+		morph_key(morph, &morph->offsets[i], cls[v], &key);
+
+		size_t slot = hash_bytes(&key, offsetof(MorphKey, id)) & (size - 1);
+		while (table[slot].cls != PMX_INVALID_IDX &&
+		       memcmp(&table[slot], &key, offsetof(MorphKey, id)))
+			slot = (slot + 1) & (size - 1);
+
+		if (table[slot].cls == PMX_INVALID_IDX) {
+			key.id = next_id++;
+			table[slot] = key;
+		}
+		cls[v] = table[slot].id;
+	}
+
+	free(table);
+	return next_id;
+}
+
+int pmx_weld_vertices(PMXModel *model)
+{
+	uint32_t vertex_count = model->vertex_count;
+
+	for (size_t i = 0; i < model->face_count; ++i) {
+		for (size_t j = 0; j < 3; ++j) {
+			if (model->faces[i].indices[j] >= vertex_count) {
+				pmx_set_error_msg("Face %zu references vertex %u out of range\n",
+					i, model->faces[i].indices[j]);
+				return -1;
+			}
+		}
+	}
+	for (size_t i = 0; i < model->morph_count; ++i) {
+		PMXMorph *morph = &model->morphs[i];
+		if (!is_vertex_morph(morph->type))
+			continue;
+		for (size_t j = 0; j < morph->offset_count; ++j) {
+			if (*morph_vertex_idx(&morph->offsets[j]) >= vertex_count) {
+				pmx_set_error_msg("Morph %zu references vertex out of range\n", i);
+				return -1;
+			}
+		}
+	}
+
+	if (vertex_count == 0)
+		return 0;
+
+	/* initial classes: the first bitwise identical vertex */
+	uint32_t *cls = malloc(vertex_count * sizeof(uint32_t));
+	size_t size = table_size(vertex_count);
+	uint32_t *table = malloc(size * sizeof(uint32_t));
+	if (!cls || !table) {
+		free(table);
+		free(cls);
+		goto oom;
+	}
+	memset(table, 0xff, size * sizeof(uint32_t));
+
+	for (uint32_t v = 0; v < vertex_count; ++v) {
+		size_t slot = hash_vertex(model, v) & (size - 1);
+		while (table[slot] != PMX_INVALID_IDX && !vertex_equal(model, table[slot], v))
+			slot = (slot + 1) & (size - 1);
+		if (table[slot] == PMX_INVALID_IDX)
+			table[slot] = v;
+		cls[v] = table[slot];
+	}
+	free(table);
+
+	uint32_t next_id = vertex_count;
+	for (size_t i = 0; i < model->morph_count && next_id != PMX_INVALID_IDX; ++i)
+		if (is_vertex_morph(model->morphs[i].type))
+			next_id = refine_by_morph(&model->morphs[i], cls, next_id);
+	if (next_id == PMX_INVALID_IDX) {
+		free(cls);
+		goto oom;
+	}
+
+	/* representative of each final class is its first member */
+	uint32_t *rep = malloc(vertex_count * sizeof(uint32_t));
+	uint32_t *first = malloc(next_id * sizeof(uint32_t));
+	if (!rep || !first) {
+		free(first);
+		free(rep);
+		free(cls);
+		goto oom;
+	}
+	memset(first, 0xff, next_id * sizeof(uint32_t));
+	for (uint32_t v = 0; v < vertex_count; ++v) {
+		if (first[cls[v]] == PMX_INVALID_IDX)
+			first[cls[v]] = v;
+		rep[v] = first[cls[v]];
+	}
+	free(first);
+	free(cls);
+
+	/* renumber in first-use order so materials reference compact windows */
+	uint32_t *remap = malloc(vertex_count * sizeof(uint32_t));
+	if (!remap) {
+		free(rep);
+		goto oom;
+	}
+	memset(remap, 0xff, vertex_count * sizeof(uint32_t));
+	uint32_t new_count = 0;
+	for (size_t i = 0; i < model->face_count; ++i) {
+		for (size_t j = 0; j < 3; ++j) {
+			uint32_t r = rep[model->faces[i].indices[j]];
+			if (remap[r] == PMX_INVALID_IDX)
+				remap[r] = new_count++;
+		}
+	}
+	for (uint32_t v = 0; v < vertex_count; ++v)
+		if (rep[v] == v && remap[v] == PMX_INVALID_IDX)
+			remap[v] = new_count++;
+	for (uint32_t v = 0; v < vertex_count; ++v)
+		remap[v] = remap[rep[v]];
+
+	PMXVert *vertices = pmx_alloc(&model->allocator, new_count, sizeof(PMXVert));
+	PMXFloat4 *add_uvs[PMX_MAX_ADD_UV] = { NULL };
+	int failed = !vertices;
+	for (size_t i = 0; i < model->header.uv_count; ++i) {
+		add_uvs[i] = pmx_alloc(&model->allocator, new_count, sizeof(PMXFloat4));
+		failed |= !add_uvs[i];
+	}
+	if (failed) {
+		pmx_dealloc(&model->allocator, vertices, new_count, sizeof(PMXVert));
+		for (size_t i = 0; i < model->header.uv_count; ++i)
+			pmx_dealloc(&model->allocator, add_uvs[i], new_count, sizeof(PMXFloat4));
+		free(remap);
+		free(rep);
+		goto oom;
+	}
+	for (uint32_t v = 0; v < vertex_count; ++v) {
+		if (rep[v] != v)
+			continue;
+		vertices[remap[v]] = model->vertices[v];
+		for (size_t i = 0; i < model->header.uv_count; ++i)
+			memcpy(add_uvs[i][remap[v]], model->add_uvs[i][v], sizeof(PMXFloat4));
+	}
+
+	for (size_t i = 0; i < model->face_count; ++i)
+		for (size_t j = 0; j < 3; ++j)
+			model->faces[i].indices[j] = remap[model->faces[i].indices[j]];
+
+	/* welded vertices carry the same offset as their representative,
+	 * so their entries are dropped instead of being applied twice */
+	for (size_t i = 0; i < model->morph_count; ++i) {
+		PMXMorph *morph = &model->morphs[i];
+		if (!is_vertex_morph(morph->type))
+			continue;
+		uint32_t kept = 0;
+		for (size_t j = 0; j < morph->offset_count; ++j) {
+			uint32_t v = *morph_vertex_idx(&morph->offsets[j]);
+			if (rep[v] != v)
+				continue;
+			morph->offsets[kept] = morph->offsets[j];
+			*morph_vertex_idx(&morph->offsets[kept]) = remap[v];
+			++kept;
+		}
+		morph->offset_count = kept;
+	}
+
+	pmx_dealloc(&model->allocator, model->vertices, vertex_count, sizeof(PMXVert));
+	model->vertices = vertices;
+	for (size_t i = 0; i < model->header.uv_count; ++i) {
+		pmx_dealloc(&model->allocator, model->add_uvs[i], vertex_count, sizeof(PMXFloat4));
+		model->add_uvs[i] = add_uvs[i];
+	}
+	model->vertex_count = new_count;
+
+	/* the rewritten sections no longer match any file, so pmx_reload decodes them afresh */
+	model->section_hash[PMX_SECTION_VERTICES] = 0;
+	model->section_hash[PMX_SECTION_FACES] = 0;
+	model->section_hash[PMX_SECTION_MORPHS] = 0;
+
+	free(remap);
+	free(rep);
+
+	TRACE("Welded %u vertices\n", vertex_count - new_count);
+	return vertex_count - new_count;
+
+oom:
+	pmx_set_error_msg("Out of memory\n");
+	return -1;
+}
+
+int pmx_build_index_buffer(const PMXModel *model, PMXIndexBuffer *dst)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	size_t total = 0;
+	for (size_t i = 0; i < model->material_count; ++i)
+		total += model->materials[i].face_count;
+	if (total > (size_t)model->face_count * 3) {
+		pmx_set_error_msg("Material face counts exceed the face section\n");
+		return -1;
+	}
+
+	dst->range_count = model->material_count;
+	dst->ranges = calloc(dst->range_count, sizeof(PMXIndexRange));
+	if (!dst->ranges && dst->range_count > 0)
+		goto oom;
+
+	const uint32_t *indices = (const uint32_t *)model->faces;
+	uint32_t first = 0;
+	for (size_t i = 0; i < model->material_count; ++i) {
+		PMXIndexRange *range = &dst->ranges[i];
+		uint32_t count = model->materials[i].face_count;
+		uint32_t lo = UINT32_MAX, hi = 0;
+
+		for (uint32_t j = first; j < first + count; ++j) {
+			lo = MIN(lo, indices[j]);
+			hi = MAX(hi, indices[j]);
+		}
+		if (count == 0)
+			lo = hi = 0;
+
+		range->index_count = count;
+		/* 0xffff is the primitive restart index and never emitted */
+		if (hi - lo < UINT16_MAX) {
+			range->index_size = sizeof(uint16_t);
+			range->base_vertex = lo;
+			range->vertex_count = count ? hi - lo + 1 : 0;
+			range->first_index = dst->index16_count;
+			dst->index16_count += count;
+		} else {
+			range->index_size = sizeof(uint32_t);
+			range->base_vertex = 0;
+			range->vertex_count = hi + 1;
+			range->first_index = dst->index32_count;
+			dst->index32_count += count;
+		}
+		first += count;
+	}
+
+	if (dst->index16_count > 0) {
+		dst->indices16 = malloc(dst->index16_count * sizeof(uint16_t));
+		if (!dst->indices16)
+			goto oom;
+	}
+	if (dst->index32_count > 0) {
+		dst->indices32 = malloc(dst->index32_count * sizeof(uint32_t));
+		if (!dst->indices32)
+			goto oom;
+	}
+
+	first = 0;
+	for (size_t i = 0; i < dst->range_count; ++i) {
+		const PMXIndexRange *range = &dst->ranges[i];
+		if (range->index_size == sizeof(uint16_t)) {
+			uint16_t *out = dst->indices16 + range->first_index;
+			for (uint32_t j = 0; j < range->index_count; ++j)
+				out[j] = (uint16_t)(indices[first + j] - range->base_vertex);
+		} else {
+			memcpy(dst->indices32 + range->first_index, indices + first,
+				range->index_count * sizeof(uint32_t));
+		}
+		first += range->index_count;
+	}
+
+	return 0;
+
+oom:
+	pmx_free_index_buffer(dst);
+	pmx_set_error_msg("Out of memory\n");
+	return -1;
+}
+
+void pmx_free_index_buffer(PMXIndexBuffer *buf)
+{
+	if (buf->ranges) {
+		free(buf->ranges);
+		buf->ranges = NULL;
+	}
+
+	if (buf->indices16) {
+		free(buf->indices16);
+		buf->indices16 = NULL;
+	}
+
+	if (buf->indices32) {
+		free(buf->indices32);
+		buf->indices32 = NULL;
+	}
+}
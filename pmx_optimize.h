@@ -0,0 +1,49 @@
+#ifndef __PMX_OPTIMIZE_H
+#define __PMX_OPTIMIZE_H
+
+#include "pmx_model.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/* Draw range of one material. first_index points into indices16 or
+ * indices32 depending on index_size; the vertex used by a draw is
+ * base_vertex + index, and all of them lie in [base_vertex, base_vertex + vertex_count). */
+typedef struct
+{
+	uint32_t first_index;
+	uint32_t index_count;
+	uint32_t base_vertex;
+	uint32_t vertex_count;
+	uint8_t index_size;
+} PMXIndexRange;
+
+typedef struct
+{
+	uint32_t range_count;
+	PMXIndexRange *ranges;
+	uint32_t index16_count;
+	uint16_t *indices16;
+	uint32_t index32_count;
+	uint32_t *indices32;
+} PMXIndexBuffer;
+
+/* Merges bitwise identical vertices (additional UVs included) that are also
+ * moved identically by every vertex and UV morph, then renumbers vertices in
+ * first-use order of the faces so each material references a compact window. Faces and morph offsets are
+ * remapped in place; a later pmx_reload decodes vertices, faces and morphs again.
+ * Returns the number of removed vertices, or -1 on error. */
+int pmx_weld_vertices(PMXModel *model);
+
+/* Rebases every material's index range to its own vertex window and stores
+ * it with 16-bit indices whenever the window spans at most 65535 vertices,
+ * so no index equals the primitive restart value 0xffff. */
+int pmx_build_index_buffer(const PMXModel *model, PMXIndexBuffer *dst);
+void pmx_free_index_buffer(PMXIndexBuffer *buf);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus 
+
+#endif // __PMX_OPTIMIZE_H
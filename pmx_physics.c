@@ -0,0 +1,222 @@
+#include "pmx_physics.h"
+#include "pmx_internal.h"
+
+#define BLOCK_ALIGN 8
+
+/* all arrays live in one block, laid out in two passes: sizing, then carving */
+static void layout(PMXPhysics *dst, uintptr_t *cursor, uint32_t body_count, uint32_t joint_count)
+{
+	dst->collide = pmx_carve(cursor, (size_t)body_count * dst->row_words * sizeof(uint64_t), BLOCK_ALIGN);
+
+	dst->shape = pmx_carve(cursor, body_count * sizeof(uint8_t), BLOCK_ALIGN);
+	dst->type = pmx_carve(cursor, body_count * sizeof(uint8_t), BLOCK_ALIGN);
+	dst->size = pmx_carve(cursor, body_count * sizeof(*dst->size), BLOCK_ALIGN);
+	dst->mass = pmx_carve(cursor, body_count * sizeof(float), BLOCK_ALIGN);
+	dst->inv_mass = pmx_carve(cursor, body_count * sizeof(float), BLOCK_ALIGN);
+	dst->move_decay = pmx_carve(cursor, body_count * sizeof(float), BLOCK_ALIGN);
+	dst->rot_decay = pmx_carve(cursor, body_count * sizeof(float), BLOCK_ALIGN);
+	dst->elastic = pmx_carve(cursor, body_count * sizeof(float), BLOCK_ALIGN);
+	dst->friction = pmx_carve(cursor, body_count * sizeof(float), BLOCK_ALIGN);
+
+	dst->body_a = pmx_carve(cursor, joint_count * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->body_b = pmx_carve(cursor, joint_count * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->pos_lower = pmx_carve(cursor, joint_count * sizeof(*dst->pos_lower), BLOCK_ALIGN);
+	dst->pos_upper = pmx_carve(cursor, joint_count * sizeof(*dst->pos_upper), BLOCK_ALIGN);
+	dst->rot_lower = pmx_carve(cursor, joint_count * sizeof(*dst->rot_lower), BLOCK_ALIGN);
+	dst->rot_upper = pmx_carve(cursor, joint_count * sizeof(*dst->rot_upper), BLOCK_ALIGN);
+	dst->spring_pos = pmx_carve(cursor, joint_count * sizeof(*dst->spring_pos), BLOCK_ALIGN);
+	dst->spring_rot = pmx_carve(cursor, joint_count * sizeof(*dst->spring_rot), BLOCK_ALIGN);
+
+	/* island lists are bounded by the body count */
+	dst->body_island = pmx_carve(cursor, body_count * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->island_body_first = pmx_carve(cursor, (body_count + 1) * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->island_bodies = pmx_carve(cursor, body_count * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->island_joint_first = pmx_carve(cursor, (body_count + 1) * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->island_joints = pmx_carve(cursor, joint_count * sizeof(uint32_t), BLOCK_ALIGN);
+}
+
+static uint32_t find_root(uint32_t *parent, uint32_t x)
+{
+	while (parent[x] != x) {
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+static void unite(uint32_t *parent, uint32_t *rank, uint32_t a, uint32_t b)
+{
+	a = find_root(parent, a);
+	b = find_root(parent, b);
+	if (a == b)
+		return;
+	if (rank[a] < rank[b]) {
+		uint32_t tmp = a;
+		a = b;
+		b = tmp;
+	}
+	parent[b] = a;
+	if (rank[a] == rank[b])
+		++rank[a];
+}
+
+static uint32_t collision_bit(const PMXRigidBody *body)
+{
+	return body->group < 16 ? 1U << body->group : 0;
+}
+
+static void build_collide(const PMXModel *model, PMXPhysics *dst)
+{
+	uint32_t n = dst->body_count;
+	const PMXRigidBody *bodies = model->rigidbodies;
+
+	#pragma omp parallel for
+	for (uint32_t a = 0; a < n; ++a) {
+		uint64_t *row = dst->collide + (size_t)a * dst->row_words;
+		uint32_t bit_a = collision_bit(&bodies[a]);
+
+		memset(row, 0, dst->row_words * sizeof(uint64_t));
+		for (uint32_t b = 0; b < n; ++b) {
+			if (a == b)
+				continue;
+			if ((bodies[b].no_collide_group & bit_a) &&
+			    (bodies[a].no_collide_group & collision_bit(&bodies[b])))
+				row[b / 64] |= 1ULL << (b % 64);
+		}
+	}
+}
+
+static int build_islands(PMXPhysics *dst)
+{
+	uint32_t n = dst->body_count;
+	uint32_t *parent = malloc(n * sizeof(uint32_t));
+	uint32_t *rank = calloc(n, sizeof(uint32_t));
+	uint32_t *root_island = malloc(n * sizeof(uint32_t));
+	if (!parent || !rank || !root_island) {
+		free(root_island);
+		free(rank);
+		free(parent);
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < n; ++i)
+		parent[i] = i;
+	for (uint32_t j = 0; j < dst->joint_count; ++j) {
+		uint32_t a = dst->body_a[j], b = dst->body_b[j];
+		if (dst->type[a] != RIGIDBODY_TYPE_STATIC && dst->type[b] != RIGIDBODY_TYPE_STATIC)
+			unite(parent, rank, a, b);
+	}
+
+	/* number islands in order of their first body, then counting-sort members */
+	memset(root_island, 0xff, n * sizeof(uint32_t));
+	memset(dst->island_body_first, 0, (n + 1) * sizeof(uint32_t));
+	memset(dst->island_joint_first, 0, (n + 1) * sizeof(uint32_t));
+	dst->island_count = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		uint32_t root = find_root(parent, i);
+		if (root_island[root] == PMX_INVALID_IDX)
+			root_island[root] = dst->island_count++;
+		dst->body_island[i] = root_island[root];
+		++dst->island_body_first[dst->body_island[i] + 1];
+	}
+
+	for (uint32_t j = 0; j < dst->joint_count; ++j) {
+		uint32_t a = dst->body_a[j];
+		uint32_t owner = dst->type[a] != RIGIDBODY_TYPE_STATIC ? a : dst->body_b[j];
+		++dst->island_joint_first[dst->body_island[owner] + 1];
+	}
+
+	for (uint32_t i = 0; i < dst->island_count; ++i) {
+		dst->island_body_first[i + 1] += dst->island_body_first[i];
+		dst->island_joint_first[i + 1] += dst->island_joint_first[i];
+	}
+
+	/* rank is reused as the fill cursor of each island */
+	memcpy(rank, dst->island_body_first, dst->island_count * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; ++i)
+		dst->island_bodies[rank[dst->body_island[i]]++] = i;
+
+	memcpy(rank, dst->island_joint_first, dst->island_count * sizeof(uint32_t));
+	for (uint32_t j = 0; j < dst->joint_count; ++j) {
+		uint32_t a = dst->body_a[j];
+		uint32_t owner = dst->type[a] != RIGIDBODY_TYPE_STATIC ? a : dst->body_b[j];
+		dst->island_joints[rank[dst->body_island[owner]]++] = j;
+	}
+
+	free(root_island);
+	free(rank);
+	free(parent);
+	return 0;
+}
+
+int pmx_build_physics(const PMXModel *model, PMXPhysics *dst)
+{
+	uint32_t n = model->rigidbody_count;
+	uint32_t joint_count = 0;
+
+	memset(dst, 0, sizeof(*dst));
+	for (size_t i = 0; i < model->joint_count; ++i)
+		if (model->joints[i].idx1 < n && model->joints[i].idx2 < n)
+			++joint_count;
+
+	dst->body_count = n;
+	dst->joint_count = joint_count;
+	dst->row_words = (n + 63) / 64;
+
+	uintptr_t cursor = 0;
+	layout(dst, &cursor, n, joint_count);
+	dst->block = malloc(MAX(cursor, 1));
+	if (!dst->block) {
+		pmx_set_error_msg("Out of memory for physics\n");
+		return -1;
+	}
+	cursor = (uintptr_t)dst->block;
+	layout(dst, &cursor, n, joint_count);
+
+	for (uint32_t i = 0; i < n; ++i) {
+		const PMXRigidBody *body = &model->rigidbodies[i];
+		dst->shape[i] = body->shape;
+		dst->type[i] = body->type;
+		memcpy(dst->size[i], body->shape_size, sizeof(dst->size[i]));
+		dst->mass[i] = body->mass;
+		dst->inv_mass[i] = body->type != RIGIDBODY_TYPE_STATIC && body->mass > 0.0f ? 1.0f / body->mass : 0.0f;
+		dst->move_decay[i] = body->move_decay;
+		dst->rot_decay[i] = body->rot_decay;
+		dst->elastic[i] = body->elastic;
+		dst->friction[i] = body->friction;
+	}
+
+	uint32_t j = 0;
+	for (size_t i = 0; i < model->joint_count; ++i) {
+		const PMXJoint *joint = &model->joints[i];
+		if (joint->idx1 >= n || joint->idx2 >= n)
+			continue;
+		dst->body_a[j] = joint->idx1;
+		dst->body_b[j] = joint->idx2;
+		memcpy(dst->pos_lower[j], joint->pos_limit.lower, sizeof(dst->pos_lower[j]));
+		memcpy(dst->pos_upper[j], joint->pos_limit.upper, sizeof(dst->pos_upper[j]));
+		memcpy(dst->rot_lower[j], joint->rot_limit.lower, sizeof(dst->rot_lower[j]));
+		memcpy(dst->rot_upper[j], joint->rot_limit.upper, sizeof(dst->rot_upper[j]));
+		memcpy(dst->spring_pos[j], joint->spring_pos, sizeof(dst->spring_pos[j]));
+		memcpy(dst->spring_rot[j], joint->spring_rot, sizeof(dst->spring_rot[j]));
+		++j;
+	}
+
+	build_collide(model, dst);
+	if (n > 0 && build_islands(dst) < 0) {
+		pmx_free_physics(dst);
+		pmx_set_error_msg("Out of memory for physics islands\n");
+		return -1;
+	}
+
+	TRACE("Physics islands: %u\n", dst->island_count);
+	return 0;
+}
+
+void pmx_free_physics(PMXPhysics *physics)
+{
+	if (physics->block) {
+		free(physics->block);
+		memset(physics, 0, sizeof(*physics));
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef __PMX_PHYSICS_H
+#define __PMX_PHYSICS_H
+
+#include "pmx_model.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/* Derived physics data in structure-of-arrays form.
+ *
+ * collide is a body_count x body_count bit matrix with row_words 64-bit words
+ * per row. Bodies a and b may collide when each one's group bit is set in the
+ * other's no_collide_group mask, which is how MMD-compatible runtimes apply
+ * the stored mask.
+ *
+ * Islands are the connected components of the joint graph over non-static
+ * bodies. Static bodies follow their bone and never link islands, so each one
+ * forms an island of its own; a joint belongs to the island of its dynamic end.
+ * Islands share no dynamic body and can be stepped in parallel. */
+typedef struct
+{
+	uint32_t body_count;
+	uint32_t row_words;
+	uint64_t *collide;
+
+	uint8_t *shape;
+	uint8_t *type;
+	float (*size)[3];
+	float *mass;
+	float *inv_mass;
+	float *move_decay;
+	float *rot_decay;
+	float *elastic;
+	float *friction;
+
+	uint32_t joint_count;
+	uint32_t *body_a;
+	uint32_t *body_b;
+	float (*pos_lower)[3];
+	float (*pos_upper)[3];
+	float (*rot_lower)[3];
+	float (*rot_upper)[3];
+	float (*spring_pos)[3];
+	float (*spring_rot)[3];
+
+	uint32_t island_count;
+	uint32_t *body_island;
+	uint32_t *island_body_first;
+	uint32_t *island_bodies;
+	uint32_t *island_joint_first;
+	uint32_t *island_joints;
+
+	void *block;
+} PMXPhysics;
+
+/* Joints referencing bodies out of range are left out of joint_count. */
+int pmx_build_physics(const PMXModel *model, PMXPhysics *dst);
+void pmx_free_physics(PMXPhysics *physics);
+
+static inline int pmx_physics_can_collide(const PMXPhysics *physics, uint32_t a, uint32_t b)
+{
+	return (physics->collide[(size_t)a * physics->row_words + b / 64] >> (b % 64)) & 1;
+}
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus 
+
+#endif // __PMX_PHYSICS_H
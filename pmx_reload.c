@@ -0,0 +1,131 @@
+#include "pmx_model.h"
+#include "pmx_internal.h"
+
+#define HASH_K0 0x9e3779b97f4a7c15ULL
+#define HASH_K1 0xc2b2ae3d27d4eb4fULL
+
+static uint64_t mix(uint64_t h, uint64_t w)
+{
+	h ^= w * HASH_K1;
+	h = (h << 31) | (h >> 33);
+	return h * HASH_K0;
+}
+
+/* four independent lanes keep the multiplies pipelined on large sections */
+uint64_t pmx_hash_range(const char *src, size_t size)
+{
+	uint64_t h[4] = { size, HASH_K0, HASH_K1, ~(uint64_t)size };
+	uint64_t w;
+	size_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		for (size_t j = 0; j < 4; ++j) {
+			memcpy(&w, src + i + 8 * j, sizeof(w));
+			h[j] = mix(h[j], w);
+		}
+	}
+	for (; i + 8 <= size; i += 8) {
+		memcpy(&w, src + i, sizeof(w));
+		h[0] = mix(h[0], w);
+	}
+	if (i < size) {
+		w = 0;
+		memcpy(&w, src + i, size - i);
+		h[1] = mix(h[1], w);
+	}
+
+	uint64_t r = mix(mix(mix(h[0], h[1]), h[2]), h[3]);
+	r ^= r >> 29;
+	return r;
+}
+
+static int skim_sections(const char *src, size_t len, const PMXHeader *header,
+			 const char **begin, const char **end, uint64_t *hash)
+{
+	const char *p = src + sizeof(*header);
+	for (int i = 0; i < PMX_SECTION_COUNT; ++i) {
+		begin[i] = p;
+		end[i] = p = pmx_skim_section(src, p, src + len, header, i);
+		if (!p)
+			return -1;
+		hash[i] = pmx_hash_range(begin[i], end[i] - begin[i]);
+	}
+	return 0;
+}
+
+int pmx_hash_sections(const char *src, size_t len, PMXModel *model)
+{
+	const char *begin[PMX_SECTION_COUNT];
+	const char *end[PMX_SECTION_COUNT];
+
+	if (len < sizeof(model->header) || memcmp(src, &model->header, sizeof(model->header))) {
+		pmx_set_error_msg("File header does not match the model\n");
+		return -1;
+	}
+	return skim_sections(src, len, &model->header, begin, end, model->section_hash);
+}
+
+static int reload_all(const char *src, size_t len, PMXModel *model, uint32_t *changed)
+{
+	PMXModel next;
+
+	if (pmx_parse_n(src, len, &next, &model->allocator))
+		return -1;
+	if (pmx_hash_sections(src, len, &next)) {
+		pmx_free(&next);
+		return -1;
+	}
+	pmx_free(model);
+	*model = next;
+	*changed = PMX_SECTION_ALL;
+	return 0;
+}
+
+int pmx_reload(const char *src, size_t len, PMXModel *model, uint32_t *changed)
+{
+	const char *begin[PMX_SECTION_COUNT];
+	const char *end[PMX_SECTION_COUNT];
+	uint64_t hash[PMX_SECTION_COUNT];
+	uint32_t mask = 0;
+
+	*changed = 0;
+	if (len < sizeof(model->header) || memcmp(src, &model->header, sizeof(model->header)))
+		return reload_all(src, len, model, changed);
+
+	if (skim_sections(src, len, &model->header, begin, end, hash))
+		return -1;
+	for (int i = 0; i < PMX_SECTION_COUNT; ++i)
+		if (hash[i] != model->section_hash[i])
+			mask |= PMX_SECTION_BIT(i);
+
+	/* decode into a copy so a failure leaves the model untouched */
+	PMXModel next = *model;
+	for (int i = 0; i < PMX_SECTION_COUNT; ++i) {
+		if (!(mask & PMX_SECTION_BIT(i)))
+			continue;
+
+		const char *parsed = pmx_parse_section(begin[i], &next, i);
+		if (parsed != end[i]) {
+			if (parsed)
+				pmx_set_error_msg("Section %d changed size while decoding\n", i);
+			for (int j = 0; j <= i; ++j)
+				if (mask & PMX_SECTION_BIT(j))
+					pmx_free_section(&next, j);
+			return -1;
+		}
+		next.section_hash[i] = hash[i];
+	}
+
+	for (int i = 0; i < PMX_SECTION_COUNT; ++i)
+		if (mask & PMX_SECTION_BIT(i))
+			pmx_free_section(model, i);
+	*model = next;
+
+	if (mask & (PMX_SECTION_BIT(PMX_SECTION_VERTICES) | PMX_SECTION_BIT(PMX_SECTION_FACES) |
+		    PMX_SECTION_BIT(PMX_SECTION_MATERIALS)))
+		pmx_compute_mat_bounds(model);
+
+	TRACE("Reloaded sections: %#x\n", mask);
+	*changed = mask;
+	return 0;
+}
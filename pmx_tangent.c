@@ -0,0 +1,274 @@
+#include "pmx_tangent.h"
+#include "pmx_internal.h"
+
+#include <float.h>
+#include <math.h>
+
+/* faces per parallel job; jobs never cross a material boundary */
+#define JOB_FACES 4096
+
+typedef float v4 __attribute__((vector_size(16)));
+
+typedef struct
+{
+	v4 normal;
+	v4 tangent;
+	v4 bitangent;
+	float angle[3];
+} FaceFrame;
+
+typedef struct
+{
+	uint32_t first;
+	uint32_t count;
+} Job;
+
+static v4 load3(const float *p)
+{
+	return (v4){ p[0], p[1], p[2], 0.0f };
+}
+
+static float dot3(v4 a, v4 b)
+{
+	v4 m = a * b;
+	return m[0] + m[1] + m[2];
+}
+
+static v4 cross3(v4 a, v4 b)
+{
+	return (v4){ a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0], 0.0f };
+}
+
+static v4 normalize3(v4 a)
+{
+	float len = sqrtf(dot3(a, a));
+	return len > FLT_MIN ? a / len : (v4){ 0.0f };
+}
+
+static float corner_angle(v4 a, v4 b)
+{
+	float c = dot3(normalize3(a), normalize3(b));
+	return acosf(c < -1.0f ? -1.0f : (c > 1.0f ? 1.0f : c));
+}
+
+static void face_frame(const PMXModel *model, const uint32_t *idx, FaceFrame *dst)
+{
+	memset(dst, 0, sizeof(*dst));
+	if (idx[0] >= model->vertex_count || idx[1] >= model->vertex_count || idx[2] >= model->vertex_count)
+		return;
+
+	const PMXVert *v0 = &model->vertices[idx[0]];
+	const PMXVert *v1 = &model->vertices[idx[1]];
+	const PMXVert *v2 = &model->vertices[idx[2]];
+	v4 p0 = load3(v0->pos), p1 = load3(v1->pos), p2 = load3(v2->pos);
+	v4 e1 = p1 - p0, e2 = p2 - p0;
+
+	dst->normal = normalize3(cross3(e1, e2));
+	dst->angle[0] = corner_angle(e1, e2);
+	dst->angle[1] = corner_angle(p2 - p1, p0 - p1);
+	dst->angle[2] = corner_angle(p0 - p2, p1 - p2);
+
+	float s1 = v1->uv[0] - v0->uv[0], t1 = v1->uv[1] - v0->uv[1];
+	float s2 = v2->uv[0] - v0->uv[0], t2 = v2->uv[1] - v0->uv[1];
+	float det = s1 * t2 - s2 * t1;
+	/* degenerate UVs contribute no tangent */
+	if (fabsf(det) <= FLT_MIN)
+		return;
+	dst->tangent = normalize3((e1 * t2 - e2 * t1) / det);
+	dst->bitangent = normalize3((e2 * s1 - e1 * s2) / det);
+}
+
+static v4 project(v4 v, v4 n)
+{
+	return normalize3(v - n * dot3(n, v));
+}
+
+/* any unit vector perpendicular to n, for vertices without a UV gradient */
+static v4 perpendicular(v4 n)
+{
+	v4 axis = fabsf(n[0]) < 0.9f ? (v4){ 1.0f, 0.0f, 0.0f, 0.0f } : (v4){ 0.0f, 1.0f, 0.0f, 0.0f };
+	return normalize3(cross3(n, axis));
+}
+
+static uint32_t hash_pos(const float pos[3])
+{
+	const uint8_t *p = (const uint8_t *)pos;
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < sizeof(float[3]); ++i) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* Vertices split along UV seams share a position but not an index. Their
+ * normals are summed over every face touching the position, so both sides of
+ * a seam light the same. */
+static int smooth_normals(const PMXModel *model, const FaceFrame *frames, const uint32_t *corner_first,
+			  const uint32_t *corners, float (*normals)[3])
+{
+	uint32_t n = model->vertex_count;
+	size_t size = 16;
+	while (size < 2 * (size_t)n)
+		size <<= 1;
+
+	uint32_t *table = malloc(size * sizeof(uint32_t));
+	uint32_t *first = malloc(MAX(n, 1) * sizeof(uint32_t));
+	v4 *sums = malloc(MAX(n, 1) * sizeof(v4));
+	if (!table || !first || !sums) {
+		free(sums);
+		free(first);
+		free(table);
+		return -1;
+	}
+	memset(table, 0xff, size * sizeof(uint32_t));
+
+	/* first vertex at each bitwise identical position */
+	for (uint32_t v = 0; v < n; ++v) {
+		const float *pos = model->vertices[v].pos;
+		size_t slot = hash_pos(pos) & (size - 1);
+		while (table[slot] != PMX_INVALID_IDX && memcmp(model->vertices[table[slot]].pos, pos, sizeof(float[3])))
+			slot = (slot + 1) & (size - 1);
+		if (table[slot] == PMX_INVALID_IDX)
+			table[slot] = v;
+		first[v] = table[slot];
+	}
+	free(table);
+
+	#pragma omp parallel for
+	for (size_t v = 0; v < n; ++v) {
+		v4 sum = { 0.0f };
+		for (size_t k = corner_first[v]; k < corner_first[v + 1]; ++k) {
+			const FaceFrame *frame = &frames[corners[k] / 3];
+			sum += frame->normal * frame->angle[corners[k] % 3];
+		}
+		sums[v] = sum;
+	}
+	/* first[v] < v for every other member, so its sum is complete by then */
+	for (uint32_t v = 0; v < n; ++v)
+		if (first[v] != v)
+			sums[first[v]] += sums[v];
+
+	#pragma omp parallel for
+	for (size_t v = 0; v < n; ++v) {
+		v4 sum = sums[first[v]];
+		v4 normal = dot3(sum, sum) > FLT_MIN ? normalize3(sum) : normalize3(load3(model->vertices[v].normal));
+		memcpy(normals[v], &normal, sizeof(normals[v]));
+	}
+
+	free(sums);
+	free(first);
+	return 0;
+}
+
+static Job *build_jobs(const PMXModel *model, size_t *job_count)
+{
+	size_t face_count = model->face_count;
+	size_t max_jobs = model->material_count + 1 + face_count / JOB_FACES;
+	Job *jobs = malloc(MAX(max_jobs, 1) * sizeof(Job));
+	size_t count = 0;
+	size_t first = 0;
+	if (!jobs)
+		return NULL;
+
+	for (size_t i = 0; i <= model->material_count && first < face_count; ++i) {
+		/* faces past the last material form a final range */
+		size_t last = i < model->material_count ? first + model->materials[i].face_count / 3 : face_count;
+		last = MIN(last, face_count);
+		for (size_t f = first; f < last; f += JOB_FACES)
+			jobs[count++] = (Job){ f, MIN(JOB_FACES, last - f) };
+		first = last;
+	}
+
+	*job_count = count;
+	return jobs;
+}
+
+int pmx_build_tangents(const PMXModel *model, uint32_t flags, PMXTangentFrames *dst)
+{
+	uint32_t vertex_count = model->vertex_count;
+	size_t corner_count = (size_t)model->face_count * 3;
+	const uint32_t *indices = (const uint32_t *)model->faces;
+
+	memset(dst, 0, sizeof(*dst));
+	if ((vertex_count && !model->vertices) || (corner_count && !model->faces)) {
+		pmx_set_error_msg("Tangents need vertices and faces decoded into the model\n");
+		return -1;
+	}
+
+	dst->vertex_count = vertex_count;
+	dst->tangents = malloc(MAX(vertex_count, 1) * sizeof(PMXFloat4));
+	if (flags & PMX_TANGENT_NORMALS)
+		dst->normals = malloc(MAX(vertex_count, 1) * sizeof(*dst->normals));
+
+	size_t job_count = 0;
+	Job *jobs = build_jobs(model, &job_count);
+	FaceFrame *frames = malloc(MAX(model->face_count, 1) * sizeof(FaceFrame));
+	uint32_t *corner_first = calloc((size_t)vertex_count + 1, sizeof(uint32_t));
+	uint32_t *corners = malloc(MAX(corner_count, 1) * sizeof(uint32_t));
+	uint32_t *cursor = malloc(MAX(vertex_count, 1) * sizeof(uint32_t));
+	int ret = -1;
+	if (!dst->tangents || ((flags & PMX_TANGENT_NORMALS) && !dst->normals) ||
+	    !jobs || !frames || !corner_first || !corners || !cursor)
+		goto out;
+
+	#pragma omp parallel for schedule(dynamic)
+	for (size_t j = 0; j < job_count; ++j)
+		for (size_t f = jobs[j].first; f < jobs[j].first + jobs[j].count; ++f)
+			face_frame(model, indices + 3 * f, &frames[f]);
+
+	/* corners grouped by vertex, so every vertex gathers without atomics */
+	for (size_t c = 0; c < corner_count; ++c)
+		if (indices[c] < vertex_count)
+			++corner_first[indices[c] + 1];
+	for (size_t v = 0; v < vertex_count; ++v)
+		corner_first[v + 1] += corner_first[v];
+	memcpy(cursor, corner_first, vertex_count * sizeof(uint32_t));
+	for (size_t c = 0; c < corner_count; ++c)
+		if (indices[c] < vertex_count)
+			corners[cursor[indices[c]]++] = c;
+
+	if (dst->normals && smooth_normals(model, frames, corner_first, corners, dst->normals))
+		goto out;
+
+	#pragma omp parallel for
+	for (size_t v = 0; v < vertex_count; ++v) {
+		v4 n = dst->normals ? load3(dst->normals[v]) : normalize3(load3(model->vertices[v].normal));
+		v4 t = { 0.0f }, b = { 0.0f };
+		for (size_t k = corner_first[v]; k < corner_first[v + 1]; ++k) {
+			const FaceFrame *frame = &frames[corners[k] / 3];
+			float angle = frame->angle[corners[k] % 3];
+			t += project(frame->tangent, n) * angle;
+			b += project(frame->bitangent, n) * angle;
+		}
+
+		t = dot3(t, t) > FLT_MIN ? normalize3(t) : perpendicular(n);
+		float *out = dst->tangents[v];
+		out[0] = t[0];
+		out[1] = t[1];
+		out[2] = t[2];
+		out[3] = dot3(cross3(n, t), b) < 0.0f ? -1.0f : 1.0f;
+	}
+	ret = 0;
+	TRACE("Tangents: %u vertices, %zu jobs\n", vertex_count, job_count);
+
+out:
+	free(cursor);
+	free(corners);
+	free(corner_first);
+	free(frames);
+	free(jobs);
+	if (ret) {
+		pmx_free_tangents(dst);
+		pmx_set_error_msg("Out of memory for tangents\n");
+	}
+	return ret;
+}
+
+void pmx_free_tangents(PMXTangentFrames *frames)
+{
+	free(frames->tangents);
+	free(frames->normals);
+	memset(frames, 0, sizeof(*frames));
+}
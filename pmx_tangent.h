@@ -0,0 +1,35 @@
+#ifndef __PMX_TANGENT_H
+#define __PMX_TANGENT_H
+
+#include "pmx_model.h"
+
+#define PMX_TANGENT_NORMALS (1U << 0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/* Per-vertex tangent frames following the MikkTSpace conventions: face
+ * tangents are projected onto the vertex normal, normalized and weighted by
+ * the corner angle, and the bitangent is w * cross(normal, tangent). UVs are
+ * used as stored. Vertices shared by faces with mirrored UVs keep a single
+ * frame, as the vertex buffer is not split. */
+typedef struct
+{
+	uint32_t vertex_count;
+	PMXFloat4 *tangents;
+	/* angle-weighted smooth normals with PMX_TANGENT_NORMALS, NULL otherwise;
+	 * vertices at the same position, e.g. both sides of a UV seam, share one */
+	float (*normals)[3];
+} PMXTangentFrames;
+
+/* Faces are processed per material range in parallel when built with OpenMP.
+ * Without PMX_TANGENT_NORMALS the model's own normals are used. */
+int pmx_build_tangents(const PMXModel *model, uint32_t flags, PMXTangentFrames *dst);
+void pmx_free_tangents(PMXTangentFrames *frames);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // __PMX_TANGENT_H
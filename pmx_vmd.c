@@ -0,0 +1,477 @@
+#include "pmx_vmd.h"
+#include "pmx_internal.h"
+
+#include <errno.h>
+#include <iconv.h>
+#include <stddef.h>
+#include <math.h>
+
+#define VMD_SIG_LEN 30
+#define VMD_BONE_KEY_SIZE 111
+#define VMD_MORPH_KEY_SIZE 23
+
+/* 2^-16 of the segment is below what a 30 fps key can resolve */
+#define BEZIER_STEPS 16
+
+/* key vectors are loaded as v4 */
+#define BLOCK_ALIGN 16
+
+typedef float v4 __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+/* A key's name, frame and record index, sorted to group keys into tracks. */
+typedef struct
+{
+	char name[VMD_NAME_LEN];
+	uint32_t frame;
+	uint32_t index;
+} KeyRef;
+
+typedef struct
+{
+	char name[VMD_NAME_LEN];
+	uint32_t index;
+} NameRef;
+
+static void layout(PMXMotionBinding *dst, uintptr_t *cursor, uint32_t bone_tracks, uint32_t bone_keys,
+		   uint32_t morph_tracks, uint32_t morph_keys)
+{
+	dst->bone_key_pos = pmx_carve(cursor, bone_keys * sizeof(PMXFloat4), BLOCK_ALIGN);
+	dst->bone_key_rot = pmx_carve(cursor, bone_keys * sizeof(PMXFloat4), BLOCK_ALIGN);
+	dst->bone_key_curve = pmx_carve(cursor, bone_keys * sizeof(*dst->bone_key_curve), BLOCK_ALIGN);
+	dst->bone_key_frame = pmx_carve(cursor, bone_keys * sizeof(float), BLOCK_ALIGN);
+	dst->bone_track_bone = pmx_carve(cursor, bone_tracks * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->bone_track_first = pmx_carve(cursor, (bone_tracks + 1) * sizeof(uint32_t), BLOCK_ALIGN);
+
+	dst->morph_key_frame = pmx_carve(cursor, morph_keys * sizeof(float), BLOCK_ALIGN);
+	dst->morph_key_weight = pmx_carve(cursor, morph_keys * sizeof(float), BLOCK_ALIGN);
+	dst->morph_track_morph = pmx_carve(cursor, morph_tracks * sizeof(uint32_t), BLOCK_ALIGN);
+	dst->morph_track_first = pmx_carve(cursor, (morph_tracks + 1) * sizeof(uint32_t), BLOCK_ALIGN);
+}
+
+/* names are NUL padded, anything after the first NUL is ignored */
+static void copy_name(char dst[VMD_NAME_LEN], const char *src)
+{
+	size_t len = strnlen(src, VMD_NAME_LEN);
+	memcpy(dst, src, len);
+	memset(dst + len, 0, VMD_NAME_LEN - len);
+}
+
+int pmx_parse_vmd(const char *src, size_t len, PMXMotion *dst)
+{
+	const char *end = src + len;
+	size_t name_len;
+
+	memset(dst, 0, sizeof(*dst));
+	if (len >= VMD_SIG_LEN && !strncmp(src, "Vocaloid Motion Data 0002", 25))
+		name_len = VMD_MODEL_NAME_LEN;
+	else if (len >= VMD_SIG_LEN && !strncmp(src, "Vocaloid Motion Data file", 25))
+		name_len = 10;
+	else {
+		pmx_set_error_msg("Not a vmd file\n");
+		return -1;
+	}
+
+	const char *p = src + VMD_SIG_LEN;
+	if ((size_t)(end - p) < name_len + sizeof(uint32_t))
+		goto overrun;
+	memcpy(dst->model_name, p, name_len);
+	p += name_len;
+
+	memcpy(&dst->bone_key_count, p, sizeof(uint32_t));
+	p += sizeof(uint32_t);
+	if ((size_t)(end - p) / VMD_BONE_KEY_SIZE < dst->bone_key_count)
+		goto overrun;
+	dst->bone_keys = p;
+	p += (size_t)dst->bone_key_count * VMD_BONE_KEY_SIZE;
+
+	/* motions saved without morphs may end after the bone keys */
+	if (p == end)
+		return 0;
+	if ((size_t)(end - p) < sizeof(uint32_t))
+		goto overrun;
+	memcpy(&dst->morph_key_count, p, sizeof(uint32_t));
+	p += sizeof(uint32_t);
+	if ((size_t)(end - p) / VMD_MORPH_KEY_SIZE < dst->morph_key_count)
+		goto overrun;
+	dst->morph_keys = p;
+	return 0;
+
+overrun:
+	pmx_set_error_msg("Truncated vmd file\n");
+	return -1;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+	const KeyRef *x = a, *y = b;
+	int c = memcmp(x->name, y->name, VMD_NAME_LEN);
+	if (c)
+		return c;
+	if (x->frame != y->frame)
+		return x->frame < y->frame ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	const NameRef *x = a, *y = b;
+	int c = memcmp(x->name, y->name, VMD_NAME_LEN);
+	if (c)
+		return c;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int cmp_name_only(const void *a, const void *b)
+{
+	return memcmp(((const NameRef *)a)->name, ((const NameRef *)b)->name, VMD_NAME_LEN);
+}
+
+static KeyRef *sort_keys(const char *records, size_t record_size, uint32_t count)
+{
+	KeyRef *keys = malloc(MAX(count, 1) * sizeof(KeyRef));
+	if (!keys)
+		return NULL;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		const char *record = records + (size_t)i * record_size;
+		copy_name(keys[i].name, record);
+		memcpy(&keys[i].frame, record + VMD_NAME_LEN, sizeof(uint32_t));
+		keys[i].index = i;
+	}
+	qsort(keys, count, sizeof(KeyRef), cmp_key);
+	return keys;
+}
+
+/* MMD truncates names to VMD_NAME_LEN bytes of Shift-JIS, possibly mid-character.
+ * Returns -1 for a name with no Shift-JIS form, which cannot match any track. */
+static int sjis_name(iconv_t cd, const PMXText *text, char dst[VMD_NAME_LEN])
+{
+	char out[2 * MAX_TEXT_LEN];
+	char *inp = (char *)pmx_text_data(text), *outp = out;
+	size_t in_left = text->len, out_left = sizeof(out);
+
+	iconv(cd, NULL, NULL, NULL, NULL);
+	/* running out of room only means the name is longer than VMD_NAME_LEN */
+	if (iconv(cd, &inp, &in_left, &outp, &out_left) == (size_t)-1 && errno != E2BIG)
+		return -1;
+
+	size_t len = MIN((size_t)(outp - out), VMD_NAME_LEN);
+	memcpy(dst, out, len);
+	memset(dst + len, 0, VMD_NAME_LEN - len);
+	return 0;
+}
+
+/* names without a Shift-JIS form are left out, *valid counts the rest */
+static NameRef *sort_names(iconv_t cd, const void *array, size_t stride, size_t offset, uint32_t count,
+			   uint32_t *valid)
+{
+	NameRef *names = malloc(MAX(count, 1) * sizeof(NameRef));
+	uint32_t n = 0;
+	if (!names)
+		return NULL;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		if (sjis_name(cd, (const PMXText *)((const char *)array + i * stride + offset), names[n].name))
+			continue;
+		names[n++].index = i;
+	}
+	qsort(names, n, sizeof(NameRef), cmp_name);
+	*valid = n;
+	return names;
+}
+
+/* the first model entry of that name, like MMD */
+static uint32_t resolve(const NameRef *names, uint32_t count, const char name[VMD_NAME_LEN])
+{
+	NameRef key;
+	memcpy(key.name, name, VMD_NAME_LEN);
+
+	const NameRef *found = bsearch(&key, names, count, sizeof(NameRef), cmp_name_only);
+	if (!found)
+		return PMX_INVALID_IDX;
+	while (found > names && !cmp_name_only(found - 1, &key))
+		--found;
+	return found->index;
+}
+
+/* Counts tracks and keys that bind; with track_target set, also fills them. Of keys on
+ * the same frame the one saved last wins. */
+static void build_tracks(const KeyRef *keys, uint32_t key_count, const NameRef *names, uint32_t name_count,
+			 uint32_t *track_count, uint32_t *bound_count, uint32_t *unbound_count,
+			 uint32_t *track_target, uint32_t *track_first, void (*emit)(void *, uint32_t, uint32_t), void *user)
+{
+	uint32_t tracks = 0, bound = 0, unbound = 0;
+
+	for (uint32_t i = 0; i < key_count;) {
+		uint32_t j = i;
+		while (j < key_count && !memcmp(keys[j].name, keys[i].name, VMD_NAME_LEN))
+			++j;
+
+		uint32_t target = resolve(names, name_count, keys[i].name);
+		if (target == PMX_INVALID_IDX) {
+			unbound += j - i;
+			i = j;
+			continue;
+		}
+
+		if (track_target) {
+			track_target[tracks] = target;
+			track_first[tracks] = bound;
+		}
+		for (uint32_t k = i; k < j; ++k) {
+			if (k + 1 < j && keys[k + 1].frame == keys[k].frame)
+				continue;
+			if (emit)
+				emit(user, bound, keys[k].index);
+			++bound;
+		}
+		++tracks;
+		i = j;
+	}
+
+	if (track_first)
+		track_first[tracks] = bound;
+	*track_count = tracks;
+	*bound_count = bound;
+	*unbound_count = unbound;
+}
+
+typedef struct
+{
+	const PMXMotion *motion;
+	PMXMotionBinding *dst;
+} EmitContext;
+
+static void emit_bone_key(void *user, uint32_t slot, uint32_t index)
+{
+	EmitContext *ctx = user;
+	PMXMotionBinding *dst = ctx->dst;
+	const char *record = ctx->motion->bone_keys + (size_t)index * VMD_BONE_KEY_SIZE;
+	const uint8_t *interp = (const uint8_t *)record + 47;
+	uint32_t frame;
+
+	memcpy(&frame, record + 15, sizeof(frame));
+	dst->bone_key_frame[slot] = (float)frame;
+	dst->last_frame = MAX(dst->last_frame, (float)frame);
+
+	memcpy(dst->bone_key_pos[slot], record + 19, 3 * sizeof(float));
+	dst->bone_key_pos[slot][3] = 0.0f;
+	memcpy(dst->bone_key_rot[slot], record + 31, 4 * sizeof(float));
+
+	/* the first 16 bytes hold x1, y1, x2, y2 for the x, y, z and rotation channels */
+	for (size_t p = 0; p < 4; ++p)
+		for (size_t c = 0; c < 4; ++c)
+			dst->bone_key_curve[slot][p][c] = interp[4 * p + c] / 127.0f;
+}
+
+static void emit_morph_key(void *user, uint32_t slot, uint32_t index)
+{
+	EmitContext *ctx = user;
+	PMXMotionBinding *dst = ctx->dst;
+	const char *record = ctx->motion->morph_keys + (size_t)index * VMD_MORPH_KEY_SIZE;
+	uint32_t frame;
+
+	memcpy(&frame, record + 15, sizeof(frame));
+	dst->morph_key_frame[slot] = (float)frame;
+	dst->last_frame = MAX(dst->last_frame, (float)frame);
+	memcpy(&dst->morph_key_weight[slot], record + 19, sizeof(float));
+}
+
+int pmx_bind_motion(const PMXMotion *motion, const PMXModel *model, PMXMotionBinding *dst)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	iconv_t cd = iconv_open("CP932", model->header.text_enc == TEXT_ENC_UTF8 ? "UTF-8" : "UTF-16LE");
+	if (cd == (iconv_t)-1) {
+		pmx_set_error_msg("No Shift-JIS conversion available for name binding\n");
+		return -1;
+	}
+	uint32_t bone_name_count = 0, morph_name_count = 0;
+	NameRef *bone_names = sort_names(cd, model->bones, sizeof(PMXBone), offsetof(PMXBone, name_jp),
+					 model->bone_count, &bone_name_count);
+	NameRef *morph_names = sort_names(cd, model->morphs, sizeof(PMXMorph), offsetof(PMXMorph, name_jp),
+					  model->morph_count, &morph_name_count);
+	iconv_close(cd);
+
+	KeyRef *bone_keys = sort_keys(motion->bone_keys, VMD_BONE_KEY_SIZE, motion->bone_key_count);
+	KeyRef *morph_keys = sort_keys(motion->morph_keys, VMD_MORPH_KEY_SIZE, motion->morph_key_count);
+	int ret = -1;
+	if (!bone_names || !morph_names || !bone_keys || !morph_keys)
+		goto out;
+
+	uint32_t bone_tracks, bone_bound, bone_unbound;
+	uint32_t morph_tracks, morph_bound, morph_unbound;
+	build_tracks(bone_keys, motion->bone_key_count, bone_names, bone_name_count,
+		     &bone_tracks, &bone_bound, &bone_unbound, NULL, NULL, NULL, NULL);
+	build_tracks(morph_keys, motion->morph_key_count, morph_names, morph_name_count,
+		     &morph_tracks, &morph_bound, &morph_unbound, NULL, NULL, NULL, NULL);
+
+	uintptr_t cursor = 0;
+	layout(dst, &cursor, bone_tracks, bone_bound, morph_tracks, morph_bound);
+	dst->block = aligned_alloc(BLOCK_ALIGN, MAX(cursor, BLOCK_ALIGN));
+	if (!dst->block)
+		goto out;
+	cursor = (uintptr_t)dst->block;
+	layout(dst, &cursor, bone_tracks, bone_bound, morph_tracks, morph_bound);
+
+	EmitContext ctx = { motion, dst };
+	build_tracks(bone_keys, motion->bone_key_count, bone_names, bone_name_count,
+		     &dst->bone_track_count, &bone_bound, &bone_unbound,
+		     dst->bone_track_bone, dst->bone_track_first, emit_bone_key, &ctx);
+	build_tracks(morph_keys, motion->morph_key_count, morph_names, morph_name_count,
+		     &dst->morph_track_count, &morph_bound, &morph_unbound,
+		     dst->morph_track_morph, dst->morph_track_first, emit_morph_key, &ctx);
+	dst->unbound_key_count = bone_unbound + morph_unbound;
+	ret = 0;
+	TRACE("Motion: %u bone tracks, %u morph tracks, %u unbound keys\n",
+	      dst->bone_track_count, dst->morph_track_count, dst->unbound_key_count);
+
+out:
+	free(morph_keys);
+	free(bone_keys);
+	free(morph_names);
+	free(bone_names);
+	if (ret)
+		pmx_set_error_msg("Out of memory for motion binding\n");
+	return ret;
+}
+
+void pmx_free_motion_binding(PMXMotionBinding *binding)
+{
+	free(binding->block);
+	memset(binding, 0, sizeof(*binding));
+}
+
+int pmx_init_motion_cursor(const PMXMotionBinding *binding, PMXMotionCursor *cursor)
+{
+	size_t count = (size_t)binding->bone_track_count + binding->morph_track_count;
+
+	cursor->bone_key = calloc(MAX(count, 1), sizeof(uint32_t));
+	if (!cursor->bone_key) {
+		pmx_set_error_msg("Out of memory for motion cursor\n");
+		return -1;
+	}
+	cursor->morph_key = cursor->bone_key + binding->bone_track_count;
+	return 0;
+}
+
+void pmx_free_motion_cursor(PMXMotionCursor *cursor)
+{
+	free(cursor->bone_key);
+	memset(cursor, 0, sizeof(*cursor));
+}
+
+static v4 load4(const float *p)
+{
+	v4 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void store4(float *p, v4 v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static v4 bezier(v4 p1, v4 p2, v4 s)
+{
+	v4 t = 1.0f - s;
+	return 3.0f * t * t * s * p1 + 3.0f * t * s * s * p2 + s * s * s;
+}
+
+/* Progress of all four channels at x. The curves are monotonic in x, so a
+ * fixed-step bisection on the curve parameter runs all channels in lockstep
+ * without branches. */
+static v4 bezier4(const float *curve, float x)
+{
+	v4 x1 = load4(curve), y1 = load4(curve + 4);
+	v4 x2 = load4(curve + 8), y2 = load4(curve + 12);
+	v4 target = { x, x, x, x };
+	v4 lo = { 0.0f }, hi = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+	for (int i = 0; i < BEZIER_STEPS; ++i) {
+		v4 s = 0.5f * (lo + hi);
+		v4i below = bezier(x1, x2, s) < target;
+		lo = (v4)(((v4i)s & below) | ((v4i)lo & ~below));
+		hi = (v4)(((v4i)hi & below) | ((v4i)s & ~below));
+	}
+	return bezier(y1, y2, 0.5f * (lo + hi));
+}
+
+static v4 slerp(v4 a, v4 b, float t)
+{
+	v4 m = a * b;
+	float d = m[0] + m[1] + m[2] + m[3];
+	if (d < 0.0f) {
+		b = -b;
+		d = -d;
+	}
+
+	float wa = 1.0f - t, wb = t;
+	/* nearly parallel rotations fall back to a normalized lerp */
+	if (d < 0.9995f) {
+		float theta = acosf(d), sn = sinf(theta);
+		wa = sinf(wa * theta) / sn;
+		wb = sinf(wb * theta) / sn;
+	}
+
+	v4 r = wa * a + wb * b;
+	m = r * r;
+	return r / sqrtf(m[0] + m[1] + m[2] + m[3]);
+}
+
+/* Advances cursor to the key at or before frame within [first, last) and
+ * returns its index; frame before the first key clamps to it. */
+static uint32_t step_cursor(const float *key_frame, uint32_t first, uint32_t last, uint32_t *cursor, float frame)
+{
+	uint32_t k = first + *cursor;
+	if (k >= last || frame < key_frame[k])
+		k = first;
+	while (k + 1 < last && key_frame[k + 1] <= frame)
+		++k;
+	*cursor = k - first;
+	return k;
+}
+
+void pmx_sample_motion(const PMXMotionBinding *binding, PMXMotionCursor *cursor, float frame,
+		       PMXFloat4 *translations, PMXFloat4 *rotations, float *morph_weights)
+{
+	if (translations || rotations) {
+		for (uint32_t t = 0; t < binding->bone_track_count; ++t) {
+			uint32_t first = binding->bone_track_first[t], last = binding->bone_track_first[t + 1];
+			uint32_t k = step_cursor(binding->bone_key_frame, first, last, &cursor->bone_key[t], frame);
+			uint32_t bone = binding->bone_track_bone[t];
+			v4 pos = load4(binding->bone_key_pos[k]);
+			v4 rot = load4(binding->bone_key_rot[k]);
+
+			/* between keys k and k + 1, shaped by the curve stored on k + 1 */
+			if (k + 1 < last && frame > binding->bone_key_frame[k]) {
+				float f0 = binding->bone_key_frame[k], f1 = binding->bone_key_frame[k + 1];
+				v4 w = bezier4(binding->bone_key_curve[k + 1][0], (frame - f0) / (f1 - f0));
+				pos += (load4(binding->bone_key_pos[k + 1]) - pos) * w;
+				pos[3] = 0.0f;
+				rot = slerp(rot, load4(binding->bone_key_rot[k + 1]), w[3]);
+			}
+
+			if (translations)
+				store4(translations[bone], pos);
+			if (rotations)
+				store4(rotations[bone], rot);
+		}
+	}
+
+	if (morph_weights) {
+		for (uint32_t t = 0; t < binding->morph_track_count; ++t) {
+			uint32_t first = binding->morph_track_first[t], last = binding->morph_track_first[t + 1];
+			uint32_t k = step_cursor(binding->morph_key_frame, first, last, &cursor->morph_key[t], frame);
+			float weight = binding->morph_key_weight[k];
+
+			if (k + 1 < last && frame > binding->morph_key_frame[k]) {
+				float f0 = binding->morph_key_frame[k], f1 = binding->morph_key_frame[k + 1];
+				weight += (binding->morph_key_weight[k + 1] - weight) * (frame - f0) / (f1 - f0);
+			}
+			morph_weights[binding->morph_track_morph[t]] = weight;
+		}
+	}
+}
@@ -0,0 +1,84 @@
+#ifndef __PMX_VMD_H
+#define __PMX_VMD_H
+
+#include "pmx_model.h"
+
+#define VMD_NAME_LEN 15
+#define VMD_MODEL_NAME_LEN 20
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/* A parsed motion points into the source buffer, which must outlive it.
+ * Bone keys are 111-byte and morph keys 23-byte records, in file order.
+ * Camera, light and the remaining sections are not read. */
+typedef struct
+{
+	char model_name[VMD_MODEL_NAME_LEN + 1];
+	uint32_t bone_key_count;
+	const char *bone_keys;
+	uint32_t morph_key_count;
+	const char *morph_keys;
+} PMXMotion;
+
+/* Keys grouped into one track per model bone or morph, sorted by frame.
+ * Track i's keys are [track_first[i], track_first[i + 1]). Translations are
+ * offsets from the bone's rest position and rotations xyzw quaternions, as
+ * stored in the file. bone_key_curve holds the Bézier control points x1, y1,
+ * x2, y2 of the segment ending at each key, each as a vector over the x, y,
+ * z and rotation channels. */
+typedef struct
+{
+	uint32_t bone_track_count;
+	uint32_t *bone_track_bone;
+	uint32_t *bone_track_first;
+	float *bone_key_frame;
+	PMXFloat4 *bone_key_pos;
+	PMXFloat4 *bone_key_rot;
+	PMXFloat4 (*bone_key_curve)[4];
+
+	uint32_t morph_track_count;
+	uint32_t *morph_track_morph;
+	uint32_t *morph_track_first;
+	float *morph_key_frame;
+	float *morph_key_weight;
+
+	/* keys whose name matched no bone or morph */
+	uint32_t unbound_key_count;
+	float last_frame;
+	void *block;
+} PMXMotionBinding;
+
+/* Current key of every track. Sampling steps it forward from the previous
+ * call, so sequential playback needs no search; seeking backwards rescans
+ * from the first key. */
+typedef struct
+{
+	uint32_t *bone_key;
+	uint32_t *morph_key;
+} PMXMotionCursor;
+
+/* Never reads past src + len and allocates nothing. */
+int pmx_parse_vmd(const char *src, size_t len, PMXMotion *dst);
+
+/* Resolves track names against the model's Japanese bone and morph names the
+ * way MMD does, by their first VMD_NAME_LEN bytes in Shift-JIS. Model names
+ * that do not convert to Shift-JIS never bind. */
+int pmx_bind_motion(const PMXMotion *motion, const PMXModel *model, PMXMotionBinding *dst);
+void pmx_free_motion_binding(PMXMotionBinding *binding);
+
+int pmx_init_motion_cursor(const PMXMotionBinding *binding, PMXMotionCursor *cursor);
+void pmx_free_motion_cursor(PMXMotionCursor *cursor);
+
+/* Writes the pose at frame (30 per second) for every bound track, indexed by
+ * model bone and morph; entries without a track are left untouched. Any of
+ * the outputs may be NULL. */
+void pmx_sample_motion(const PMXMotionBinding *binding, PMXMotionCursor *cursor, float frame,
+		       PMXFloat4 *translations, PMXFloat4 *rotations, float *morph_weights);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // __PMX_VMD_H
@@ -0,0 +1,543 @@
+#include "pmx_write.h"
+#include "pmx_internal.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#define WRITE_BUFFER_SIZE (64 * 1024)
+#define WRITE_IOV_COUNT 64
+/* runs at least this long are handed to the sink in place instead of copied */
+#define WRITE_DIRECT_MIN 4096
+
+typedef struct
+{
+	const PMXWriteSink *sink;
+	PMXHeader header;
+	char *buf;
+	size_t used;
+	struct iovec iov[WRITE_IOV_COUNT];
+	int iov_count;
+	/* the last iovec is the open tail of buf */
+	int tail_open;
+	int failed;
+} Writer;
+
+static void flush(Writer *w)
+{
+	if (w->iov_count > 0 && !w->failed && w->sink->write(w->sink->user, w->iov, w->iov_count)) {
+		pmx_set_error_msg("Write failed\n");
+		w->failed = 1;
+	}
+	w->iov_count = 0;
+	w->used = 0;
+	w->tail_open = 0;
+}
+
+/* returns size bytes of staging space appended to the output */
+static char *reserve(Writer *w, size_t size)
+{
+	if (WRITE_BUFFER_SIZE - w->used < size)
+		flush(w);
+	if (!w->tail_open) {
+		if (w->iov_count == WRITE_IOV_COUNT)
+			flush(w);
+		w->iov[w->iov_count++] = (struct iovec){ w->buf + w->used, 0 };
+		w->tail_open = 1;
+	}
+
+	char *dst = w->buf + w->used;
+	w->iov[w->iov_count - 1].iov_len += size;
+	w->used += size;
+	return dst;
+}
+
+static void put(Writer *w, const void *src, size_t size)
+{
+	if (size < WRITE_DIRECT_MIN) {
+		memcpy(reserve(w, size), src, size);
+		return;
+	}
+
+	if (w->iov_count == WRITE_IOV_COUNT)
+		flush(w);
+	w->iov[w->iov_count++] = (struct iovec){ (void *)src, size };
+	w->tail_open = 0;
+}
+
+static void put_u8(Writer *w, uint8_t value)
+{
+	*reserve(w, 1) = (char)value;
+}
+
+static void put_u16(Writer *w, uint16_t value)
+{
+	memcpy(reserve(w, sizeof(value)), &value, sizeof(value));
+}
+
+static void put_u32(Writer *w, uint32_t value)
+{
+	memcpy(reserve(w, sizeof(value)), &value, sizeof(value));
+}
+
+static void put_float(Writer *w, const float *src, size_t count)
+{
+	memcpy(reserve(w, count * sizeof(float)), src, count * sizeof(float));
+}
+
+static void encode_index(char *dst, uint32_t value, size_t size)
+{
+	switch (size) {
+	case 1:
+		*dst = (char)(uint8_t)value;
+		break;
+	case 2: {
+		uint16_t v = (uint16_t)value;
+		memcpy(dst, &v, sizeof(v));
+		break;
+	}
+	case 4:
+		memcpy(dst, &value, sizeof(value));
+		break;
+	}
+}
+
+/* signed index kinds use -1 for "none", which narrow fields zero-extend to 255 or 65535 */
+static void put_index(Writer *w, uint32_t value, size_t size, uint32_t count)
+{
+	encode_index(reserve(w, size), value < count ? value : UINT32_MAX, size);
+}
+
+/* the largest index is count - 1, so INT8_MAX + 1 entries still fit a signed byte */
+static uint8_t signed_index_size(uint32_t count)
+{
+	if (count <= INT8_MAX + 1)
+		return 1;
+	if (count <= INT16_MAX + 1)
+		return 2;
+	return 4;
+}
+
+static uint8_t vertex_index_size(uint32_t count)
+{
+	if (count <= UINT8_MAX)
+		return 1;
+	if (count <= UINT16_MAX)
+		return 2;
+	return 4;
+}
+
+static void put_text(Writer *w, const PMXText *text)
+{
+	put_u32(w, text->len);
+	put(w, pmx_text_data(text), text->len);
+}
+
+static int write_vertices(Writer *w, const PMXModel *model)
+{
+	size_t bone = w->header.bone_idx_size;
+	uint32_t bones = model->bone_count;
+
+	put_u32(w, model->vertex_count);
+	for (size_t i = 0; i < model->vertex_count; ++i) {
+		const PMXVert *vert = &model->vertices[i];
+
+		/* pos, normal and uv are contiguous floats, as in the file */
+		put_float(w, vert->pos, 8);
+		for (size_t j = 0; j < w->header.uv_count; ++j)
+			put_float(w, model->add_uvs[j][i], 4);
+
+		put_u8(w, vert->weight_type);
+		switch (vert->weight_type) {
+		case BDEF1:
+			put_index(w, vert->weight.bdef1.idx0, bone, bones);
+			break;
+		case BDEF2:
+			put_index(w, vert->weight.bdef2.idx0, bone, bones);
+			put_index(w, vert->weight.bdef2.idx1, bone, bones);
+			put_float(w, &vert->weight.bdef2.w0, 1);
+			break;
+		case BDEF4:
+			for (size_t j = 0; j < 4; ++j)
+				put_index(w, vert->weight.bdef4.idx[j], bone, bones);
+			put(w, vert->weight.bdef4.w, sizeof(vert->weight.bdef4.w));
+			break;
+		case SDEF:
+			put_index(w, vert->weight.sdef.idx0, bone, bones);
+			put_index(w, vert->weight.sdef.idx1, bone, bones);
+			put_float(w, &vert->weight.sdef.w0, 1);
+			put_float(w, vert->weight.sdef.c, 3);
+			put_float(w, vert->weight.sdef.r0, 3);
+			put_float(w, vert->weight.sdef.r1, 3);
+			break;
+		default:
+			pmx_set_error_msg("Vertex %zu has unknown weight type %u\n", i, vert->weight_type);
+			return -1;
+		}
+		put_float(w, &vert->edge_scale, 1);
+	}
+
+	return 0;
+}
+
+static int write_faces(Writer *w, const PMXModel *model)
+{
+	const uint32_t *indices = (const uint32_t *)model->faces;
+	size_t index_count = (size_t)model->face_count * 3;
+	size_t size = w->header.vert_idx_size;
+
+	for (size_t i = 0; i < index_count; ++i) {
+		if (indices[i] >= model->vertex_count) {
+			pmx_set_error_msg("Face index %zu points past the vertices\n", i);
+			return -1;
+		}
+	}
+
+	put_u32(w, index_count);
+	if (size == sizeof(uint32_t)) {
+		put(w, indices, index_count * sizeof(uint32_t));
+		return 0;
+	}
+
+	/* narrowed in buffer-sized chunks */
+	size_t chunk = WRITE_BUFFER_SIZE / size;
+	for (size_t first = 0; first < index_count; first += chunk) {
+		size_t n = MIN(chunk, index_count - first);
+		char *dst = reserve(w, n * size);
+		for (size_t i = 0; i < n; ++i)
+			encode_index(dst + i * size, indices[first + i], size);
+	}
+	return 0;
+}
+
+static void write_materials(Writer *w, const PMXModel *model)
+{
+	size_t tex = w->header.tex_idx_size;
+	uint32_t textures = model->texture_count;
+
+	put_u32(w, model->material_count);
+	for (size_t i = 0; i < model->material_count; ++i) {
+		const PMXMat *mat = &model->materials[i];
+		put_text(w, &mat->name_jp);
+		put_text(w, &mat->name_en);
+		put_float(w, mat->diffuse, 4);
+		put_float(w, mat->specular, 3);
+		put_float(w, &mat->power, 1);
+		put_float(w, mat->ambient, 3);
+		put_u8(w, mat->draw_mode);
+		put_float(w, mat->edge, 4);
+		put_float(w, &mat->edge_size, 1);
+		put_index(w, mat->tex_idx, tex, textures);
+		put_index(w, mat->env_idx, tex, textures);
+		put_u8(w, mat->env_mode);
+		put_u8(w, mat->toon_mode);
+		if (mat->toon_mode == TOON_TEX)
+			put_index(w, mat->toon_idx, tex, textures);
+		else
+			put_u8(w, mat->toon_idx);
+		put_text(w, &mat->memo);
+		put_u32(w, mat->face_count);
+	}
+}
+
+static void write_bones(Writer *w, const PMXModel *model)
+{
+	size_t bone = w->header.bone_idx_size;
+	uint32_t bones = model->bone_count;
+
+	put_u32(w, bones);
+	for (size_t i = 0; i < bones; ++i) {
+		const PMXBone *b = &model->bones[i];
+		uint16_t flags = b->flags;
+
+		put_text(w, &b->name_jp);
+		put_text(w, &b->name_en);
+		put_float(w, b->pos, 3);
+		put_index(w, b->parent, bone, bones);
+		put_u32(w, b->transform_layer);
+		put_u16(w, flags);
+
+		if (flags & BONE_FLAG_CONNECTED)
+			put_index(w, b->tip.target, bone, bones);
+		else
+			put_float(w, b->tip.offset, 3);
+
+		if (flags & BONE_FLAG_LINK_ROTATION || flags & BONE_FLAG_LINK_MOVE) {
+			put_index(w, b->link.idx, bone, bones);
+			put_float(w, &b->link.rate, 1);
+		}
+
+		if (flags & BONE_FLAG_FIXED_AXIS)
+			put_float(w, b->fixed_axis, 3);
+
+		if (flags & BONE_FLAG_LOCAL_AXIS) {
+			put_float(w, b->local_axis.x, 3);
+			put_float(w, b->local_axis.z, 3);
+		}
+
+		if (flags & BONE_FLAG_EXT_PARENT_TRANSFORM)
+			put_u32(w, b->ext_parent_key);
+
+		if (flags & BONE_FLAG_IK) {
+			put_index(w, b->ik.idx, bone, bones);
+			put_u32(w, b->ik.loop);
+			put_float(w, &b->ik.limit_angle, 1);
+			put_u32(w, b->ik.link_count);
+			for (size_t j = 0; j < b->ik.link_count; ++j) {
+				const PMXIKLink *link = &b->ik.links[j];
+				put_index(w, link->idx, bone, bones);
+				put_u8(w, link->has_limit);
+				if (link->has_limit) {
+					put_float(w, link->limit.lower, 3);
+					put_float(w, link->limit.upper, 3);
+				}
+			}
+		}
+	}
+}
+
+static int write_morphs(Writer *w, const PMXModel *model)
+{
+	const PMXHeader *header = &w->header;
+
+	put_u32(w, model->morph_count);
+	for (size_t i = 0; i < model->morph_count; ++i) {
+		const PMXMorph *morph = &model->morphs[i];
+
+		put_text(w, &morph->name_jp);
+		put_text(w, &morph->name_en);
+		put_u8(w, morph->panel);
+		put_u8(w, morph->type);
+		put_u32(w, morph->offset_count);
+		for (size_t j = 0; j < morph->offset_count; ++j) {
+			const PMXMorphOffset *off = &morph->offsets[j];
+			switch (morph->type) {
+			case MORPH_TYPE_GROUP:
+			case MORPH_TYPE_FLIP:
+				put_index(w, off->group_flip.idx, header->morph_idx_size, model->morph_count);
+				put_float(w, &off->group_flip.rate, 1);
+				break;
+			case MORPH_TYPE_VERTEX:
+				put_index(w, off->vertex.idx, header->vert_idx_size, model->vertex_count);
+				put_float(w, off->vertex.offset, 3);
+				break;
+			case MORPH_TYPE_BONE:
+				put_index(w, off->bone.idx, header->bone_idx_size, model->bone_count);
+				put_float(w, off->bone.move, 3);
+				put_float(w, off->bone.rotation, 4);
+				break;
+			case MORPH_TYPE_UV:
+			case MORPH_TYPE_ADD_UV_1:
+			case MORPH_TYPE_ADD_UV_2:
+			case MORPH_TYPE_ADD_UV_3:
+			case MORPH_TYPE_ADD_UV_4:
+				put_index(w, off->uv.idx, header->vert_idx_size, model->vertex_count);
+				put_float(w, off->uv.offset, 4);
+				break;
+			case MORPH_TYPE_MATERIAL:
+				put_index(w, off->material.idx, header->mat_idx_size, model->material_count);
+				put_u8(w, off->material.method);
+				put_float(w, off->material.diffuse, 4);
+				put_float(w, off->material.specular, 3);
+				put_float(w, &off->material.power, 1);
+				put_float(w, off->material.ambient, 3);
+				put_float(w, off->material.edge, 4);
+				put_float(w, &off->material.edge_size, 1);
+				put_float(w, off->material.tex_tint, 4);
+				put_float(w, off->material.env_tint, 4);
+				put_float(w, off->material.toon_tint, 4);
+				break;
+			case MORPH_TYPE_IMPULSE:
+				put_index(w, off->impulse.idx, header->rb_idx_size, model->rigidbody_count);
+				put_u8(w, off->impulse.local);
+				put_float(w, off->impulse.velocity, 3);
+				put_float(w, off->impulse.torque, 3);
+				break;
+			default:
+				pmx_set_error_msg("Morph %zu has unknown type %u\n", i, morph->type);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int write_frames(Writer *w, const PMXModel *model)
+{
+	put_u32(w, model->frame_count);
+	for (size_t i = 0; i < model->frame_count; ++i) {
+		const PMXFrame *frame = &model->frames[i];
+
+		put_text(w, &frame->name_jp);
+		put_text(w, &frame->name_en);
+		put_u8(w, frame->special);
+		put_u32(w, frame->elem_count);
+		for (size_t j = 0; j < frame->elem_count; ++j) {
+			const PMXFrameElement *elem = &frame->elems[j];
+			put_u8(w, elem->type);
+			switch (elem->type) {
+			case FRAME_ELEM_TYPE_BONE:
+				put_index(w, elem->idx, w->header.bone_idx_size, model->bone_count);
+				break;
+			case FRAME_ELEM_TYPE_MORPH:
+				put_index(w, elem->idx, w->header.morph_idx_size, model->morph_count);
+				break;
+			default:
+				pmx_set_error_msg("Frame %zu has unknown element type %u\n", i, elem->type);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void write_rigidbodies(Writer *w, const PMXModel *model)
+{
+	put_u32(w, model->rigidbody_count);
+	for (size_t i = 0; i < model->rigidbody_count; ++i) {
+		const PMXRigidBody *body = &model->rigidbodies[i];
+
+		put_text(w, &body->name_jp);
+		put_text(w, &body->name_en);
+		put_index(w, body->bone_idx, w->header.bone_idx_size, model->bone_count);
+		put_u8(w, body->group);
+		put_u16(w, body->no_collide_group);
+		put_u8(w, body->shape);
+		put_float(w, body->shape_size, 3);
+		put_float(w, body->pos, 3);
+		put_float(w, body->rot, 3);
+		put_float(w, &body->mass, 1);
+		put_float(w, &body->move_decay, 1);
+		put_float(w, &body->rot_decay, 1);
+		put_float(w, &body->elastic, 1);
+		put_float(w, &body->friction, 1);
+		put_u8(w, body->type);
+	}
+}
+
+static void write_joints(Writer *w, const PMXModel *model)
+{
+	put_u32(w, model->joint_count);
+	for (size_t i = 0; i < model->joint_count; ++i) {
+		const PMXJoint *joint = &model->joints[i];
+
+		put_text(w, &joint->name_jp);
+		put_text(w, &joint->name_en);
+		put_u8(w, joint->type);
+		put_index(w, joint->idx1, w->header.rb_idx_size, model->rigidbody_count);
+		put_index(w, joint->idx2, w->header.rb_idx_size, model->rigidbody_count);
+		put_float(w, joint->pos, 3);
+		put_float(w, joint->rot, 3);
+		put_float(w, joint->pos_limit.lower, 3);
+		put_float(w, joint->pos_limit.upper, 3);
+		put_float(w, joint->rot_limit.lower, 3);
+		put_float(w, joint->rot_limit.upper, 3);
+		put_float(w, joint->spring_pos, 3);
+		put_float(w, joint->spring_rot, 3);
+	}
+}
+
+static int check_model(const PMXModel *model)
+{
+	if ((model->vertex_count && !model->vertices) || (model->face_count && !model->faces)) {
+		pmx_set_error_msg("Model has no vertex or face data to write\n");
+		return -1;
+	}
+	if (model->header.uv_count > PMX_MAX_ADD_UV) {
+		pmx_set_error_msg("Invalid additional UV count %u\n", model->header.uv_count);
+		return -1;
+	}
+	for (size_t i = 0; i < model->header.uv_count; ++i) {
+		if (model->vertex_count && !model->add_uvs[i]) {
+			pmx_set_error_msg("Model is missing additional UV channel %zu\n", i + 1);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int pmx_write(const PMXModel *model, const PMXWriteSink *sink)
+{
+	Writer w = { .sink = sink };
+
+	if (check_model(model))
+		return -1;
+
+	memcpy(w.header.sig, "PMX ", 4);
+	w.header.ver = model->header.ver >= 2.0f ? model->header.ver : 2.0f;
+	w.header.data_count = 8;
+	w.header.text_enc = model->header.text_enc;
+	w.header.uv_count = model->header.uv_count;
+	w.header.vert_idx_size = vertex_index_size(model->vertex_count);
+	w.header.tex_idx_size = signed_index_size(model->texture_count);
+	w.header.mat_idx_size = signed_index_size(model->material_count);
+	w.header.bone_idx_size = signed_index_size(model->bone_count);
+	w.header.morph_idx_size = signed_index_size(model->morph_count);
+	w.header.rb_idx_size = signed_index_size(model->rigidbody_count);
+
+	w.buf = malloc(WRITE_BUFFER_SIZE);
+	if (!w.buf) {
+		pmx_set_error_msg("Out of memory for write buffer\n");
+		return -1;
+	}
+
+	put(&w, &w.header, sizeof(w.header));
+	put_text(&w, &model->info.name_jp);
+	put_text(&w, &model->info.name_en);
+	put_text(&w, &model->info.comm_jp);
+	put_text(&w, &model->info.comm_en);
+
+	int ret = -1;
+	if (write_vertices(&w, model) || write_faces(&w, model))
+		goto out;
+
+	put_u32(&w, model->texture_count);
+	for (size_t i = 0; i < model->texture_count; ++i)
+		put_text(&w, &model->textures[i].name);
+
+	write_materials(&w, model);
+	write_bones(&w, model);
+	if (write_morphs(&w, model) || write_frames(&w, model))
+		goto out;
+	write_rigidbodies(&w, model);
+	write_joints(&w, model);
+
+	flush(&w);
+	ret = w.failed ? -1 : 0;
+out:
+	free(w.buf);
+	return ret;
+}
+
+static int fd_write(void *user, struct iovec *iov, int iovcnt)
+{
+	int fd = *(int *)user;
+
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		/* skip what was written, resume inside a partially written buffer */
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+int pmx_write_fd(const PMXModel *model, int fd)
+{
+	PMXWriteSink sink = { fd_write, &fd };
+	return pmx_write(model, &sink);
+}
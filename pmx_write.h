@@ -0,0 +1,30 @@
+#ifndef __PMX_WRITE_H
+#define __PMX_WRITE_H
+
+#include "pmx_model.h"
+
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/* Receives the file in order as batches of buffers. write must consume all
+ * iovcnt buffers and may modify iov while doing so; it returns 0 on success
+ * and -1 on failure. */
+typedef struct
+{
+	int (*write)(void *user, struct iovec *iov, int iovcnt);
+	void *user;
+} PMXWriteSink;
+
+/* Serializes model with the smallest index sizes its counts allow. Indices
+ * that point past their array (e.g. a parent of -1) are written as -1. */
+int pmx_write(const PMXModel *model, const PMXWriteSink *sink);
+int pmx_write_fd(const PMXModel *model, int fd);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // __PMX_WRITE_H